@@ -371,7 +371,23 @@ enum rdma_opcode {
 	RDMAP_SEND_SE		= 0x5,
 	RDMAP_SEND_SE_INVAL	= 0x6,
 	RDMAP_TERMINATE		= 0x7,
-	RDMAP_NOT_SUPPORTED	= RDMAP_TERMINATE + 1
+	//! RFC 7306, only after MPA_RR_FLAG_SUIW_EXT was negotiated
+	RDMAP_IMMEDIATE		= 0x8,
+	RDMAP_IMMEDIATE_SE	= 0x9,
+	RDMAP_ATOMIC_REQ	= 0xA,
+	RDMAP_ATOMIC_RESP	= 0xB,
+	//! SoftUiWarp private: Send carrying immediate data in rsvdULP2
+	RDMAP_SEND_IMM		= 0xC,
+	RDMAP_SEND_SE_IMM	= 0xD,
+	RDMAP_NOT_SUPPORTED	= 0xF,
+
+	//! WR only, never on the wire: an RDMA Write followed by an
+	//! Immediate Data message (Immediate Data with SE if SEND_SOLICITED)
+	RDMAP_RDMA_WRITE_IMM	= 0x10,
+	//! WR only: Atomic Requests. sg_list[0] receives the original
+	//! 64-bit value, wr.atomic describes the remote operand
+	RDMAP_ATOMIC_FETCH_ADD	= 0x11,
+	RDMAP_ATOMIC_CMP_SWP	= 0x12,
 };
 
 
@@ -44,6 +44,7 @@ struct cq* create_cq(struct rdmap_stream_context* ctx, int num_cqe) {
     cq->ctx = ctx;
     cq->q = new moodycamel::ConcurrentQueue<work_completion>(num_cqe);
     cq->pending_q = new moodycamel::ConcurrentQueue<work_completion>(num_cqe);
+    cq->timestamps = 0;
     return cq;
 }
 
@@ -68,6 +69,7 @@ struct wq* create_wq(struct rdmap_stream_context *context,
     q->pd = wq_init_attr->pd;
     q->cq = wq_init_attr->cq;
     q->wq_type = wq_init_attr->wq_type;
+    q->max_wr = wq_init_attr->max_wr;
     switch(wq_init_attr->wq_type)
     {
         case WQT_SQ: {
@@ -105,5 +107,21 @@ int destroy_wq(struct wq* q)
 int send_wr_to_wce(struct send_wr* wr, struct work_completion* wce)
 {
 	wce->wr_id = wr->wr_id;
-	wce->opcode = (enum wc_opcode)wr->opcode;
+	wce->wc_flags = 0;
+	switch (wr->opcode)
+	{
+		//! Immediate data is only reported at the receiver
+		case RDMAP_RDMA_WRITE_IMM:
+			wce->opcode = WC_WRITE;
+			break;
+		case RDMAP_SEND_IMM:
+			wce->opcode = WC_SEND;
+			break;
+		case RDMAP_SEND_SE_IMM:
+			wce->opcode = WC_SEND_SOLICIT;
+			break;
+		default:
+			wce->opcode = (enum wc_opcode)wr->opcode;
+	}
+	return 0;
 }
\ No newline at end of file
@@ -29,10 +29,12 @@
 
 #include <pthread.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <linux/types.h>
 #include "common.h"
 #include "concurrentqueue.h"
+#include "suiw_user.h"
 
 enum wc_status {
 	WC_SUCCESS,
@@ -71,8 +73,8 @@ enum wc_opcode {
     WC_SEND_SOLICIT = 5,
     WC_SEND_SOLICIT_INVALIDATE = 6,
     WC_TERMINATE = 7,
-	// WC_COMP_SWAP,
-	// WC_FETCH_ADD,
+	WC_FETCH_ADD = 0x11,
+	WC_COMP_SWAP = 0x12,
 	// WC_BIND_MW,
 	// WC_LOCAL_INV,
 	// WC_TSO,
@@ -81,7 +83,7 @@ enum wc_opcode {
  * receive by testing (opcode & WC_RECV).
  */
 	WC_RECV			= 1 << 7,
-	// WC_RECV_RDMA_WITH_IMM,
+	WC_RECV_RDMA_WITH_IMM,
 
 	// WC_TM_ADD,
 	// WC_TM_DEL,
@@ -132,6 +134,10 @@ struct work_completion {
 	uint16_t		slid;
 	uint8_t			sl;
 	uint8_t			dlid_path_bits;
+
+	//! CLOCK_MONOTONIC_RAW ns at which the completion was generated.
+	//! Only written on CQs with timestamps enabled
+	uint64_t		completion_ts;
 };
 
 struct cq {
@@ -140,8 +146,26 @@ struct cq {
 
 	//! Maintains future work completions for pending read requests
     moodycamel::ConcurrentQueue<work_completion>* pending_q;
+
+	//! Set to stamp completion_ts on every completion; off by default
+	int timestamps;
 };
 
+static inline uint64_t cq_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//! Generates a completion on `cq`, stamping it if the CQ keeps timestamps
+static inline bool cq_push(struct cq* cq, struct work_completion& wce)
+{
+	if (unlikely(cq->timestamps))
+		wce.completion_ts = cq_clock_ns();
+	return cq->q->enqueue(wce);
+}
+
 struct cq* create_cq(struct rdmap_stream_context* ctx, int num_cqe);
 
 int destroy_cq(struct cq* cq);
@@ -177,29 +201,41 @@ enum wq_type {
 struct recv_wr {
 	uint64_t		wr_id;
 
-	//! Using moodycamel queues here
-	// struct recv_wr     *next;
+	//! Optional chain, posted together by rdma_post_recv
+	struct recv_wr     *next = NULL;
 	
 	struct sge	       *sg_list;
 	int			num_sge;
 };
 
+//! Values match ibv_send_flags
+enum send_flags {
+	//! Wait until all earlier reads and atomics on this SQ have
+	//! completed (SIW_WQE_READ_FENCE). Later WRs wait behind it.
+	SEND_FENCE		= 1 << 0,
+	//! RDMAP_RDMA_WRITE_IMM: raise a solicited event at the peer
+	SEND_SOLICITED		= 1 << 2,
+	//! Copy the payload into the WR at post time; sg_list and the
+	//! buffers it points to may be reused as soon as the post returns.
+	//! At most SIW_MAX_INLINE bytes, SEND* and RDMA_WRITE only.
+	SEND_INLINE		= 1 << 3,
+};
+
 struct send_wr {
 	uint64_t		wr_id;
 
-	//! Using moodycamel queues here
-	// struct send_wr     *next;
+	//! Optional chain, posted together by rdmap_post_send
+	struct send_wr     *next = NULL;
 
 	struct sge	       *sg_list;
 	int			num_sge;
 	enum rdma_opcode	opcode;
 	unsigned int		send_flags = 0;
-	/* When opcode is *_WITH_IMM: Immediate data in network byte order.
+	/* When opcode is *_IMM: Immediate data in network byte order.
 	 * When opcode is *_INV: Stores the rkey to invalidate
 	 */
 	union {
-		//! Since everything is in userspace, no need of immediate
-		// __be32			imm_data;
+		__be32			imm_data;
 		uint32_t		invalidate_rkey;
 	};
     
@@ -212,7 +248,19 @@ struct send_wr {
 			uint64_t	remote_addr;
 			uint32_t	rkey;
 		} rdma;
+		//! Remote address must be 8 byte aligned
+		struct {
+			uint64_t	remote_addr;
+			uint64_t	compare_add;
+			uint64_t	swap;
+			uint32_t	rkey;
+		} atomic;
 	} wr;
+
+	//! Filled in at post time: a copy of sg_list (up to SIW_MAX_SGE
+	//! entries), or for SEND_INLINE, sge[0] describing the payload
+	//! copied into sge[1..]. Callers need not set it.
+	struct sge		sge[SIW_MAX_SGE];
 };
 
 struct wq {
@@ -223,6 +271,7 @@ struct wq {
 	uint32_t		handle;
 	enum wq_state       state;
 	enum wq_type	wq_type;
+	uint32_t		max_wr;
     union {
         moodycamel::ConcurrentQueue<send_wr>* send_q;
         moodycamel::ConcurrentQueue<recv_wr>* recv_q;
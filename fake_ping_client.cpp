@@ -157,7 +157,7 @@ void* cq_thread(void* data)
         int ret = cq->try_dequeue(wc);
         if (!ret) continue;
 
-        if (wc.opcode != WC_SEND || wc.wr_id != wr.wr_id) {
+        if (wc.opcode != WC_RECV || wc.wr_id != wr.wr_id) {
             continue;
         }
         if (wc.status != WC_SUCCESS)
@@ -220,6 +220,7 @@ int main(int argc, char **argv)
         lwlog_err("closing connection");
         close(sockfd);
     }
+    attr.suiw_ext = ret > 0;
     
     //! Register Buffers
     struct rdmap_stream_context* ctx = rdmap_init_stream(&attr);
@@ -254,6 +255,7 @@ int main(int argc, char **argv)
     req.sg_list = &sg;
     req.num_sge = 1;
     req.opcode = RDMAP_SEND;
+    req.send_flags = SEND_INLINE;
 
     /*
      * rping "ping/pong" loop:
@@ -73,6 +73,7 @@ static struct ibv_qp *(*real_create_qp)(struct ibv_pd*, struct ibv_qp_init_attr*
 static int (*real_modify_qp)(struct ibv_qp*, struct ibv_qp_attr*, int) = NULL;
 static int (*real_query_qp)(struct ibv_qp*, struct ibv_qp_attr*, int, struct ibv_qp_init_attr*) = NULL;
 static int (*real_destroy_qp)(struct ibv_qp*) = NULL;
+static struct ibv_qp_ex *(*real_qp_to_qp_ex)(struct ibv_qp*) = NULL;
 static struct ibv_ah *(*real_create_ah)(struct ibv_pd*, struct ibv_ah_attr*) = NULL;
 static int (*real_init_ah_from_wc)(struct ibv_context*, uint8_t, struct ibv_wc*, struct ibv_grh*, struct ibv_ah_attr*) = NULL;
 static struct ibv_ah *(*real_create_ah_from_wc)(struct ibv_pd*, struct ibv_wc*, struct ibv_grh*, uint8_t) = NULL;
@@ -258,6 +259,9 @@ int ibv_query_pkey(struct ibv_context *context, uint8_t port_num,
  */
 struct ibv_pd *ibv_alloc_pd(struct ibv_context *context) {
 	printf("ibv_alloc_pd\n");
+    if (suiw_is_device_softuiwarp(context->device)) {
+        return suiw_alloc_pd(context);
+    }
 	return NULL;
 }
 
@@ -266,6 +270,9 @@ struct ibv_pd *ibv_alloc_pd(struct ibv_context *context) {
  */
 int ibv_dealloc_pd(struct ibv_pd *pd) {
 	printf("ibv_dealloc_pd\n");
+    if (suiw_is_device_softuiwarp(pd->context->device)) {
+        return suiw_dealloc_pd(pd);
+    }
 	return -1;
 }
 
@@ -326,6 +333,9 @@ struct ibv_cq *ibv_create_cq(struct ibv_context *context, int cqe,
 			     struct ibv_comp_channel *channel,
 			     int comp_vector) {
 	printf("ibv_create_cq\n");
+    if (suiw_is_device_softuiwarp(context->device)) {
+        return suiw_create_cq(context, cqe, cq_context);
+    }
 	return NULL;
 }
 
@@ -346,6 +356,9 @@ int ibv_resize_cq(struct ibv_cq *cq, int cqe) {
  */
 int ibv_destroy_cq(struct ibv_cq *cq) {
 	printf("ibv_destroy_cq\n");
+    if (suiw_is_device_softuiwarp(cq->context->device)) {
+        return suiw_destroy_cq(cq);
+    }
 	return -1;
 }
 
@@ -443,6 +456,9 @@ int ibv_destroy_srq(struct ibv_srq *srq) {
 struct ibv_qp *ibv_create_qp(struct ibv_pd *pd,
 			     struct ibv_qp_init_attr *qp_init_attr) {
 	printf("ibv_create_qp\n");
+    if (suiw_is_device_softuiwarp(pd->context->device)) {
+        return suiw_create_qp(pd, qp_init_attr);
+    }
 	return NULL;
 }
 
@@ -478,9 +494,25 @@ int ibv_query_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
  */
 int ibv_destroy_qp(struct ibv_qp *qp) {
 	printf("ibv_destroy_qp\n");
+    if (suiw_is_device_softuiwarp(qp->context->device)) {
+        return suiw_destroy_qp(qp);
+    }
 	return -1;
 }
 
+/**
+ * ibv_qp_to_qp_ex - Get the extended QP of a QP created with
+ *   IBV_QP_INIT_ATTR_SEND_OPS_FLAGS.
+ */
+struct ibv_qp_ex *ibv_qp_to_qp_ex(struct ibv_qp *qp) {
+	printf("ibv_qp_to_qp_ex\n");
+    if (suiw_is_device_softuiwarp(qp->context->device)) {
+        return suiw_qp_to_qp_ex(qp);
+    } else {
+        return real_qp_to_qp_ex(qp);
+    }
+}
+
 /**
  * ibv_create_ah - Create an address handle.
  */
@@ -643,6 +675,7 @@ __attribute__((constructor)) static void init(void) {
     real_modify_qp = (int (*)(ibv_qp*, ibv_qp_attr*, int)) bind_symbol("ibv_modify_qp");
     real_query_qp = (int (*)(ibv_qp*, ibv_qp_attr*, int, ibv_qp_init_attr*)) bind_symbol("ibv_query_qp");
     real_destroy_qp = (int (*)(ibv_qp*)) bind_symbol("ibv_destroy_qp");
+    real_qp_to_qp_ex = (ibv_qp_ex* (*)(ibv_qp*)) bind_symbol("ibv_qp_to_qp_ex");
     real_create_ah = (ibv_ah* (*)(ibv_pd*, ibv_ah_attr*)) bind_symbol("ibv_create_ah");
     real_init_ah_from_wc = (int (*)(ibv_context*, uint8_t, ibv_wc*, ibv_grh*, ibv_ah_attr*)) bind_symbol("ibv_init_ah_from_wc");
     real_create_ah_from_wc = (ibv_ah* (*)(ibv_pd*, ibv_wc*, ibv_grh*, uint8_t)) bind_symbol("ibv_create_ah_from_wc");
@@ -213,7 +213,7 @@ int rdma_destroy_id(struct rdma_cm_id *id) {
  */
 int rdma_bind_addr(struct rdma_cm_id *id, struct sockaddr *addr) {
 	printf("rdma_bind_addr\n");
-	return -1;
+	return suiw_bind_addr(id, addr);
 }
 
 /**
@@ -288,7 +288,7 @@ int rdma_resolve_route(struct rdma_cm_id *id, int timeout_ms) {
 int rdma_create_qp(struct rdma_cm_id *id, struct ibv_pd *pd,
 		   struct ibv_qp_init_attr *qp_init_attr) {
 	printf("rdma_create_qp\n");
-	return -1;
+	return suiw_cm_create_qp(id, pd, qp_init_attr);
 }
 
 int rdma_create_qp_ex(struct rdma_cm_id *id,
@@ -310,6 +310,7 @@ int rdma_create_qp_ex(struct rdma_cm_id *id,
  */
 void rdma_destroy_qp(struct rdma_cm_id *id) {
 	printf("rdma_destroy_qp\n");
+	suiw_cm_destroy_qp(id);
 }
 
 /**
@@ -330,7 +331,7 @@ void rdma_destroy_qp(struct rdma_cm_id *id) {
  */
 int rdma_connect(struct rdma_cm_id *id, struct rdma_conn_param *conn_param) {
 	printf("rdma_connect\n");
-	return -1;
+	return suiw_connect(id, conn_param);
 }
 
 /**
@@ -374,7 +375,7 @@ int rdma_establish(struct rdma_cm_id *id) {
  */
 int rdma_listen(struct rdma_cm_id *id, int backlog) {
 	printf("rdma_listen\n");
-	return -1;
+	return suiw_listen(id, backlog);
 }
 
 /**
@@ -382,7 +383,7 @@ int rdma_listen(struct rdma_cm_id *id, int backlog) {
  */
 int rdma_get_request(struct rdma_cm_id *listen, struct rdma_cm_id **id) {
 	printf("rdma_get_request\n");
-	return -1;
+	return suiw_get_request(listen, id);
 }
 
 /**
@@ -406,7 +407,7 @@ int rdma_get_request(struct rdma_cm_id *listen, struct rdma_cm_id **id) {
  */
 int rdma_accept(struct rdma_cm_id *id, struct rdma_conn_param *conn_param) {
 	printf("rdma_accept\n");
-	return -1;
+	return suiw_accept(id, conn_param);
 }
 
 /**
@@ -428,7 +429,7 @@ int rdma_accept(struct rdma_cm_id *id, struct rdma_conn_param *conn_param) {
 int rdma_reject(struct rdma_cm_id *id, const void *private_data,
 		uint8_t private_data_len) {
 	printf("rdma_reject\n");
-	return -1;
+	return suiw_reject(id, private_data, private_data_len);
 }
 
 /**
@@ -439,7 +440,7 @@ int rdma_reject(struct rdma_cm_id *id, const void *private_data,
 int rdma_reject_ece(struct rdma_cm_id *id, const void *private_data,
 		uint8_t private_data_len) {
 	printf("rdma_reject_ece\n");
-	return -1;
+	return suiw_reject(id, private_data, private_data_len);
 }
 
 /**
@@ -478,7 +479,7 @@ int rdma_notify(struct rdma_cm_id *id, enum ibv_event_type event) {
  */
 int rdma_disconnect(struct rdma_cm_id *id) {
 	printf("rdma_disconnect\n");
-	return -1;
+	return suiw_disconnect(id);
 }
 
 /**
@@ -1,14 +1,18 @@
 #ifndef LIBSUIW_INTERNAL_H
 #define LIBSUIW_INTERNAL_H
 
-const char *daemon_hostname = "127.0.0.1";
-const char *daemon_port = "9999";
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Abstract AF_UNIX address of the daemon, so descriptors can be passed.
+const char *daemon_path = "softuiwarp-daemon";
 
 /* Library <-> Daemon messages */
 
 enum daemon_msg_t {
-    // Request daemon allocate a connection management event channel.
-    DAEMON_CREATE_EC,
     // Request daemon allocate a completion queue.
     DAEMON_CREATE_CQ,
     // Request daemon allocate a queue pair.
@@ -20,4 +24,12 @@ struct __attribute__((packed)) daemon_msg {
     daemon_msg_t type;
 };
 
+static inline socklen_t daemon_addr(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    // Leading NUL: abstract namespace, nothing to unlink.
+    strncpy(addr->sun_path + 1, daemon_path, sizeof(addr->sun_path) - 2);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(daemon_path);
+}
+
 #endif // LIBSUIW_INTERNAL_H
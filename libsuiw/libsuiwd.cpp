@@ -3,14 +3,15 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <string.h>
-#include <poll.h>
-#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <linux/types.h>
 
-#include <vector>
+#include <deque>
 
 #include <rdma/rdma_cma.h>
 
@@ -18,12 +19,37 @@
 
 // Timeout for workloop polling.
 static const int poll_timeout_ms = 1000;
+// Ready fds handled per epoll_wait.
+static const int max_events = 64;
 
 /* Internal state. */
 
+struct handler;
+
+/*
+ * Called when the handler's fd is ready.
+ *  returns: 0 to keep watching the fd, 1 to drop it, -1 to stop the daemon.
+ */
+typedef int (*handler_fn)(struct handler *h, uint32_t events);
+
+//! One per watched fd, the epoll data points straight at it
+struct handler {
+    int fd;
+    handler_fn fn;
+    const char *name;
+};
+
 static int server_fd = -1;
-static std::vector<int> ec_fds;
-static std::vector<int> cq_fds;
+static int epfd = -1;
+//! Cleared once the library hangs up
+static bool running = true;
+//! Channels the library asked for whose connection is not accepted yet
+static std::deque<daemon_msg_t> pending_kinds;
+//! Accepted connections the library has not announced yet
+static std::deque<int> unclaimed_fds;
+//! Control message read so far from the library, dispatched once complete
+static struct daemon_msg lib_msg;
+static size_t lib_msg_len = 0;
 
 /*
  * Binds server_fd to the server address and port.
@@ -31,24 +57,14 @@ static std::vector<int> cq_fds;
  */
 static int bind_server() {
     int ret;
-    // Convert the hostname to a sockaddr.
-    struct addrinfo hints;
-    bzero(&hints, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    struct addrinfo *res;
-    ret = getaddrinfo(daemon_hostname, daemon_port, &hints, &res);
-    if (ret != 0) {
-        perror("getaddrinfo");
-        return ret;
-    }
+    struct sockaddr_un addr;
+    socklen_t len = daemon_addr(&addr);
     // Bind the server.
-    ret = bind(server_fd, res->ai_addr, res->ai_addrlen);
+    ret = bind(server_fd, (struct sockaddr*) &addr, len);
     if (ret) {
         perror("bind");
         return ret;
     }
-    freeaddrinfo(res);
     // Listen for connections.
     ret = listen(server_fd, SOMAXCONN); 
     if (ret == -1) {
@@ -64,172 +80,179 @@ static int bind_server() {
  */
 static int wait_for_client_connect() {
     // Accept a connection.
-    printf("waiting for connection from libsuiw at %s:%s ... ", daemon_hostname, daemon_port);
-    int ret = accept(server_fd, 0, 0);
+    printf("waiting for connection from libsuiw at @%s ... ", daemon_path);
+    int ret = accept4(server_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
     printf("done!\n");
     return ret;
 }
 
-static void create_event_channel() {
-    printf("creating event channel\n");
-    int ec_fd = wait_for_client_connect();
-    ec_fds.push_back(ec_fd);
+/*
+ * Starts watching fd.
+ *  returns: 0 on success, -1 on failure.
+ */
+static int add_handler(int fd, handler_fn fn, const char *name) {
+    struct handler *h = (struct handler*) malloc(sizeof(struct handler));
+    h->fd = fd;
+    h->fn = fn;
+    h->name = name;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = h;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        perror("epoll_ctl");
+        free(h);
+        return -1;
+    }
+    return 0;
+}
+
+static void remove_handler(struct handler *h) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, h->fd, NULL);
+    close(h->fd);
+    free(h);
 }
 
-static void create_completion_queue() {
-    printf("creating completion queue\n");
-    int cq_fd = wait_for_client_connect();
-    cq_fds.push_back(cq_fd);
+static int cq_handle_recv(struct handler *h, uint32_t events) {
+    printf("handling cq packet for fd %d\n", h->fd);
+    char buf[256];
+    // Nothing is sent on CQ channels yet, just notice them going away.
+    int ret = recv(h->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    return (ret == 0 || (ret < 0 && errno != EAGAIN)) ? 1 : 0;
+}
+
+//! Gives an accepted connection the role the library announced for it
+static int attach_channel(daemon_msg_t kind, int fd) {
+    switch (kind) {
+        case DAEMON_CREATE_CQ:
+            printf("created completion queue %d\n", fd);
+            return add_handler(fd, cq_handle_recv, "completion queue");
+        default:
+            close(fd);
+            return -1;
+    }
+}
+
+/*
+ * The library sends the create message and then connects, but the two
+ * can reach us in either order, so whichever arrives first waits for the
+ * other.
+ */
+static void create_channel(daemon_msg_t kind) {
+    if (unclaimed_fds.empty()) {
+        pending_kinds.push_back(kind);
+        return;
+    }
+    int fd = unclaimed_fds.front();
+    unclaimed_fds.pop_front();
+    attach_channel(kind, fd);
+}
+
+static int accept_handle(struct handler *h, uint32_t events) {
+    for (;;) {
+        int fd = accept4(h->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            perror("accept");
+            return 0;
+        }
+        if (pending_kinds.empty()) {
+            unclaimed_fds.push_back(fd);
+        } else {
+            daemon_msg_t kind = pending_kinds.front();
+            pending_kinds.pop_front();
+            attach_channel(kind, fd);
+        }
+    }
 }
 
 static void create_queue_pair() {
     printf("creating queue pair\n");
 }
 
-static int lib_handle_recv(int fd) {
-    printf("handling lib msg ...\n");
-    struct daemon_msg msg;
-    int ret = recv(fd, &msg, sizeof(msg), MSG_WAITALL);
-    if (ret == -1) {
-        perror("recv");
-        return -1;
-    } else if (ret == 0) {
-        // TCP socket closed by peer.
-        return 0;
-    } else if (ret < sizeof(msg)) {
-        printf("unexpectedly received %d bytes from lib\n", ret);
-        return -1;
-    }
-    // Handle the message.
-    switch (msg.type) {
-        case DAEMON_CREATE_EC:
-            create_event_channel();
-            break;
+static void lib_handle_msg(struct daemon_msg *msg) {
+    switch (msg->type) {
         case DAEMON_CREATE_CQ:
-            create_completion_queue();
+            create_channel(msg->type);
             break;
         case DAEMON_CREATE_QP:
             create_queue_pair();
             break;
     }
-    return ret;
 }
 
-static int dpdk_handle_recv(int fd) {
+/*
+ * Reads whatever the library has sent, a message split across reads is
+ * kept in lib_msg until the rest of it arrives.
+ */
+static int lib_handle_recv(struct handler *h, uint32_t events) {
+    for (;;) {
+        int ret = recv(h->fd, (char*) &lib_msg + lib_msg_len,
+                       sizeof(lib_msg) - lib_msg_len, 0);
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            perror("recv");
+            return -1;
+        } else if (ret == 0) {
+            // TCP socket closed by peer.
+            printf("library closed connection.\n");
+            running = false;
+            return 0;
+        }
+        lib_msg_len += ret;
+        if (lib_msg_len < sizeof(lib_msg))
+            continue;
+        lib_msg_len = 0;
+        printf("handling lib msg ...\n");
+        lib_handle_msg(&lib_msg);
+    }
+}
+
+static int dpdk_handle_recv(struct handler *h, uint32_t events) {
     printf("handling dpdk packet ...\n");
+    return 0;
 }
 
-static int ec_handle_recv(int fd, size_t idx) {
-    int ret = 0;
-    rdma_cm_event event;
-    ret = recv(fd, &event, sizeof(event), 0);
-    printf("handling ec packet for fd %lu of event type %s\n", idx, rdma_event_str(event.event));
-    if (ret == -1) {
-        perror("recv");
-        return -1;
-    } else if (ret == 0) {
-        // TCP socket closed by peer.
-        return 0;
-    } else if (ret < sizeof(event)) {
-        printf("unexpectedly received %d bytes from event channel\n", ret);
+/*
+ * Dispatches ready fds to their handlers until one of them asks to stop.
+ *  returns: 0 once the library is gone, -1 on failure.
+ */
+static int workloop(int lib_fd, int dpdk_fd) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1");
         return -1;
     }
-    // TODO respond to event if necessary
-    ret = send(fd, &event, sizeof(event), 0);
-    if (ret == -1) {
-        perror("send");
-        return -1;
-    } else if (ret == 0) {
-        // TCP socket closed by peer.
-        return 0;
-    } else if (ret < sizeof(event)) {
-        printf("failed to send full event channel message\n");
+    // From here on new connections are picked up by the workloop.
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+    if (add_handler(lib_fd, lib_handle_recv, "lib") ||
+        (dpdk_fd >= 0 && add_handler(dpdk_fd, dpdk_handle_recv, "dpdk")) ||
+        add_handler(server_fd, accept_handle, "listener")) {
         return -1;
     }
-    return ret;
-}
-
-static int cq_handle_recv(int fd, size_t idx) {
-    printf("handling cq packet %lu\n", idx);
-}
-
-static int workloop(int lib_fd, int dpdk_fd) {
-    // Build poll fds.
-    short flags = POLLIN | POLLERR;
-    size_t num_fds = 2;
-    struct pollfd *fds = (pollfd*) malloc(sizeof(pollfd)*num_fds);
-    bzero(fds, num_fds*sizeof(pollfd));
-    fds[0].fd = lib_fd;
-    fds[0].events = flags;
-    fds[1].fd = dpdk_fd;
-    fds[1].events = flags;
-    // Main workloop.
-    int ret = 0;
-    while (1) {
-        // If we have new FDs to poll, re-build the pollfd structure.
-        size_t ec_fd_start = 2;
-        size_t cq_fd_start = ec_fd_start + ec_fds.size();
-        size_t new_num_fds = cq_fd_start + cq_fds.size();
-        if (num_fds != new_num_fds) {
-            printf("adding file descriptor to poll list\n");
-            num_fds = new_num_fds;
-            fds = (pollfd*) realloc(fds, sizeof(pollfd)*num_fds);
-            bzero(fds, num_fds*sizeof(pollfd));
-            size_t num_fds = 2 + ec_fds.size() + cq_fds.size();
-            for (size_t i = 0; i < num_fds; i++) {
-                if (i == 0) {
-                    fds[i].fd = lib_fd;
-                } else if (i == 1) {
-                    fds[i].fd = dpdk_fd;
-                } else if ((i-ec_fd_start) < ec_fds.size()) {
-                    fds[i].fd = ec_fds[i-ec_fd_start];
-                } else if ((i-cq_fd_start) < cq_fds.size()) {
-                    fds[i].fd = cq_fds[i-cq_fd_start];
-                }
-                fds[i].events = flags;
-            }
-        }
-        // Do the actual poll.
-        int pollret = poll(fds, num_fds, poll_timeout_ms);
-        if (pollret == -1) {
-            perror("poll");
+    struct epoll_event events[max_events];
+    while (running) {
+        int n = epoll_wait(epfd, events, max_events, poll_timeout_ms);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
             return -1;
-        } else if (pollret == 0) {
+        } else if (n == 0) {
             printf("poll timeout.\n");
             continue;
         }
-        size_t i = 0;
-        while (pollret > 0) {
-            if (fds[i].revents != 0) {
-                int error_mask = POLLERR | POLLNVAL;
-                if (fds[i].revents & POLLHUP) {
-                    printf("fd %lu unexpectedly closed connection\n", i);
-                    return -1;
-                } else if (fds[i].revents & (POLLERR | POLLNVAL)) {
-                    printf("fd %lu returned error!\n", i);
-                    return -1;
-                }
-                assert(fds[i].revents & POLLIN);
-                if (i == 0) {
-                    ret = lib_handle_recv(fds[i].fd);
-                    if (ret == 0) {
-                        printf("library closed connection.\n");
-                        return 0;
-                    }
-                } else if (i == 1) {
-                    ret = dpdk_handle_recv(fds[i].fd);
-                } else if ((i-ec_fd_start) < ec_fds.size()) {
-                    ret = ec_handle_recv(fds[i].fd, i-ec_fd_start);
-                } else if ((i-cq_fd_start) < cq_fds.size()) {
-                    ret = cq_handle_recv(fds[i].fd, i-cq_fd_start);
-                }
-                if (ret == -1) {
-                    printf("something went wrong handling packets for fd %lu!\n", i);
-                    return -1;
-                }
-                pollret--;
+        for (int i = 0; i < n; i++) {
+            struct handler *h = (struct handler*) events[i].data.ptr;
+            int ret = h->fn(h, events[i].events);
+            if (ret < 0) {
+                printf("something went wrong handling %s fd %d!\n", h->name, h->fd);
+                return -1;
+            } else if (ret > 0) {
+                printf("dropping %s fd %d\n", h->name, h->fd);
+                remove_handler(h);
             }
-            i++;
         }
     }
     return 0;
@@ -239,7 +262,7 @@ static int workloop(int lib_fd, int dpdk_fd) {
 int main(int argc, char **argv) {
     printf("libsuiw daemon process\n");
     // Create the socket.
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (server_fd == -1) {
         perror("socket");
         return -1;
@@ -1,18 +1,27 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <netdb.h>
 
+#include <pthread.h>
+#include <netinet/tcp.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <deque>
 #include <map>
 
 #include "softucommon.h"
 #include "libsuiw_internal.h"
+#include "mpa/mpa.h"
+#include "rdmap/rdmap.h"
 
 /* Internal state. */
 
@@ -44,33 +53,944 @@ static ibv_device *create_suiw_device() {
  */
 static int connect_to_daemon() {
     int ret = 0;
-    struct sockaddr_in servaddr;
     // Create the socket.
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sock == -1) {
         perror("socket");
         return -1;
     }
-    // Convert the hostname to a sockaddr.
-    struct addrinfo hints;
-    bzero(&hints, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    struct addrinfo *res;
-    ret = getaddrinfo(daemon_hostname, daemon_port, &hints, &res);
-    if (ret != 0) {
-        perror("getaddrinfo");
-        return -1;
-    }
+    struct sockaddr_un addr;
+    socklen_t len = daemon_addr(&addr);
     // Connect to the server.
-    ret = connect(sock, res->ai_addr, res->ai_addrlen);
+    ret = connect(sock, (struct sockaddr*) &addr, len);
     if (ret == -1) {
         perror("connect");
+        close(sock);
         return -1;
     }
     return sock;
 }
 
+/* Verbs objects: each wraps the ibv_* struct handed to the application
+ * around the SoftUiWarp object behind it. */
+
+struct suiw_pd {
+    ibv_pd ibv;
+    pd_t pd;
+};
+
+//! A receive WR kept with a copy of its SGEs, since the caller may reuse
+//! sg_list as soon as ibv_post_recv returns
+struct suiw_recv_slot {
+    recv_wr wr;
+    struct sge sge[SIW_MAX_SGE];
+};
+
+//! Completions pulled from the CQ ring per refill of an extended poll
+#define SUIW_CQ_POLL_BATCH 16
+
+struct suiw_cq {
+    //! ibv_cq_ex starts with the ibv_cq fields
+    union {
+        ibv_cq ibv;
+        ibv_cq_ex ex;
+    };
+    struct cq* cq;
+
+    //! ibv_start_poll/ibv_next_poll state: entries [poll_idx, poll_len)
+    //! of poll_buf have not been consumed yet
+    work_completion poll_buf[SUIW_CQ_POLL_BATCH];
+    int poll_idx;
+    int poll_len;
+};
+
+struct suiw_qp {
+    //! ibv_qp_ex starts with an ibv_qp
+    union {
+        ibv_qp ibv;
+        ibv_qp_ex ex;
+    };
+    struct wq* sq;
+    struct wq* rq;
+    uint32_t max_send_wr;
+    //! Set once the QP is connected; read with acquire on the fast path
+    struct rdmap_stream_context* ctx;
+
+    //! Guards the ctx transition and early_recvs
+    pthread_mutex_t lock;
+    //! Receives posted before the connection exists, handed to the
+    //! stream when it is set up
+    struct suiw_recv_slot* early_recvs;
+    uint32_t early_len;
+    uint32_t early_cap;
+
+    //! ibv_wr_* builder state: WRs are built in place here, in their final
+    //! SQ form, between ibv_wr_start and ibv_wr_complete
+    struct send_wr* batch;
+    uint32_t batch_len;
+    uint32_t batch_cap;
+    int batch_err;
+};
+
+static uint32_t next_pd_id = 1;
+static uint32_t next_qp_num = 1;
+
+/* The fast path reinterprets ibv_* arrays in place, so the layouts must match. */
+static_assert(sizeof(struct sge) == sizeof(ibv_sge), "sge must match ibv_sge");
+static_assert(offsetof(struct sge, lkey) == offsetof(ibv_sge, lkey), "sge must match ibv_sge");
+static_assert(offsetof(recv_wr, next) == offsetof(ibv_recv_wr, next), "recv_wr must match ibv_recv_wr");
+static_assert(offsetof(recv_wr, sg_list) == offsetof(ibv_recv_wr, sg_list), "recv_wr must match ibv_recv_wr");
+static_assert(offsetof(recv_wr, num_sge) == offsetof(ibv_recv_wr, num_sge), "recv_wr must match ibv_recv_wr");
+static_assert(offsetof(work_completion, dlid_path_bits) == offsetof(ibv_wc, dlid_path_bits),
+              "work_completion must start with an ibv_wc");
+static_assert(offsetof(work_completion, wc_flags) == offsetof(ibv_wc, wc_flags), "work_completion must match ibv_wc");
+static_assert((int) SEND_FENCE == IBV_SEND_FENCE && (int) SEND_SOLICITED == IBV_SEND_SOLICITED &&
+              (int) SEND_INLINE == IBV_SEND_INLINE, "send_flags must match ibv_send_flags");
+static_assert((int) WC_WITH_IMM == IBV_WC_WITH_IMM && (int) WC_WITH_INV == IBV_WC_WITH_INV,
+              "wc_flags must match ibv_wc_flags");
+
+static enum rdma_opcode suiw_wr_opcode(const ibv_send_wr* wr) {
+    bool se = wr->send_flags & IBV_SEND_SOLICITED;
+    switch (wr->opcode) {
+    case IBV_WR_RDMA_WRITE:             return RDMAP_RDMA_WRITE;
+    case IBV_WR_RDMA_WRITE_WITH_IMM:    return RDMAP_RDMA_WRITE_IMM;
+    case IBV_WR_SEND:                   return se ? RDMAP_SEND_SE : RDMAP_SEND;
+    case IBV_WR_SEND_WITH_IMM:          return se ? RDMAP_SEND_SE_IMM : RDMAP_SEND_IMM;
+    case IBV_WR_SEND_WITH_INV:          return se ? RDMAP_SEND_SE_INVAL : RDMAP_SEND_INVAL;
+    case IBV_WR_RDMA_READ:              return RDMAP_RDMA_READ_REQ;
+    case IBV_WR_ATOMIC_FETCH_AND_ADD:   return RDMAP_ATOMIC_FETCH_ADD;
+    case IBV_WR_ATOMIC_CMP_AND_SWP:     return RDMAP_ATOMIC_CMP_SWP;
+    default:                            return RDMAP_NOT_SUPPORTED;
+    }
+}
+
+//! Builds the SQ entry for `wr` without touching the heap: sg_list is
+//! reinterpreted in place and copied into the slot by rdmap_prep_send_wr
+static inline void suiw_to_send_wr(const ibv_send_wr* wr, struct send_wr* out) {
+    out->wr_id = wr->wr_id;
+    out->next = NULL;
+    out->sg_list = (struct sge*) wr->sg_list;
+    out->num_sge = wr->num_sge;
+    out->opcode = suiw_wr_opcode(wr);
+    out->send_flags = wr->send_flags;
+    if (wr->opcode == IBV_WR_SEND_WITH_INV)
+        out->invalidate_rkey = wr->invalidate_rkey;
+    else
+        out->imm_data = wr->imm_data;
+    if (out->opcode == RDMAP_ATOMIC_FETCH_ADD || out->opcode == RDMAP_ATOMIC_CMP_SWP) {
+        out->wr.atomic.remote_addr = wr->wr.atomic.remote_addr;
+        out->wr.atomic.compare_add = wr->wr.atomic.compare_add;
+        out->wr.atomic.swap = wr->wr.atomic.swap;
+        out->wr.atomic.rkey = wr->wr.atomic.rkey;
+    } else {
+        out->wr.rdma.remote_addr = wr->wr.rdma.remote_addr;
+        out->wr.rdma.rkey = wr->wr.rdma.rkey;
+    }
+}
+
+//! Walks an ibv_send_wr chain; `enqueue_bulk` constructs each converted
+//! WR directly in its SQ slot
+struct suiw_send_wr_iter {
+    ibv_send_wr* wr;
+
+    struct send_wr operator*() const {
+        struct send_wr slot;
+        suiw_to_send_wr(wr, &slot);
+        rdmap_prep_send_wr(&slot);
+        return slot;
+    }
+    suiw_send_wr_iter& operator++() { wr = wr->next; return *this; }
+    suiw_send_wr_iter operator++(int) { suiw_send_wr_iter it = *this; wr = wr->next; return it; }
+};
+
+static inline enum ibv_wc_opcode suiw_wc_opcode(enum wc_opcode op) {
+    switch (op) {
+    case WC_WRITE:                      return IBV_WC_RDMA_WRITE;
+    case WC_READ_REQUEST:               return IBV_WC_RDMA_READ;
+    case WC_SEND:
+    case WC_SEND_INVALIDATE:
+    case WC_SEND_SOLICIT:
+    case WC_SEND_SOLICIT_INVALIDATE:    return IBV_WC_SEND;
+    case WC_FETCH_ADD:                  return IBV_WC_FETCH_ADD;
+    case WC_COMP_SWAP:                  return IBV_WC_COMP_SWAP;
+    case WC_RECV_RDMA_WITH_IMM:         return IBV_WC_RECV_RDMA_WITH_IMM;
+    default:                            return IBV_WC_RECV;
+    }
+}
+
+//! Output iterator for `try_dequeue_bulk` that writes each completion
+//! straight into the caller's ibv_wc array
+struct suiw_wc_out_iter {
+    ibv_wc* wc;
+
+    suiw_wc_out_iter& operator*() { return *this; }
+    suiw_wc_out_iter& operator=(work_completion&& wce) {
+        memcpy(wc, &wce, sizeof(ibv_wc));
+        wc->opcode = suiw_wc_opcode(wce.opcode);
+        return *this;
+    }
+    suiw_wc_out_iter& operator++() { wc++; return *this; }
+    suiw_wc_out_iter operator++(int) { suiw_wc_out_iter it = *this; wc++; return it; }
+};
+
+static int suiw_post_send(ibv_qp *ibqp, ibv_send_wr *wr, ibv_send_wr **bad_wr) {
+    struct suiw_qp* qp = (struct suiw_qp*) ibqp;
+    struct rdmap_stream_context* ctx = __atomic_load_n(&qp->ctx, __ATOMIC_ACQUIRE);
+    *bad_wr = wr;
+    if (ctx == nullptr)
+        return ENOTCONN;
+
+    int ret = 0;
+    size_t num_wrs = 0;
+    ibv_send_wr* it = wr;
+    for (; it != nullptr; it = it->next, num_wrs++) {
+        struct send_wr slot;
+        suiw_to_send_wr(it, &slot);
+        ret = rdmap_check_send_wr(ctx, &slot);
+        if (ret < 0)
+            break;
+    }
+    *bad_wr = it;
+    if (num_wrs == 0)
+        return -ret;
+
+    if (!qp->sq->send_q->enqueue_bulk(suiw_send_wr_iter{wr}, num_wrs)) {
+        *bad_wr = wr;
+        return ENOMEM;
+    }
+    return -ret;
+}
+
+//! Keeps receives posted before the connection is up. Called with qp->lock held
+static int suiw_stash_recv(struct suiw_qp* qp, ibv_recv_wr *wr, ibv_recv_wr **bad_wr) {
+    for (; wr != nullptr; wr = wr->next) {
+        if (qp->early_len == qp->early_cap || wr->num_sge > RDMAP_MAX_RECV_SGE) {
+            *bad_wr = wr;
+            return wr->num_sge > RDMAP_MAX_RECV_SGE ? EINVAL : ENOMEM;
+        }
+        struct suiw_recv_slot* slot = &qp->early_recvs[qp->early_len++];
+        slot->wr.wr_id = wr->wr_id;
+        slot->wr.next = NULL;
+        slot->wr.sg_list = slot->sge;
+        slot->wr.num_sge = wr->num_sge;
+        memcpy(slot->sge, wr->sg_list, wr->num_sge * sizeof(struct sge));
+    }
+    return 0;
+}
+
+static int suiw_post_recv(ibv_qp *ibqp, ibv_recv_wr *wr, ibv_recv_wr **bad_wr) {
+    struct suiw_qp* qp = (struct suiw_qp*) ibqp;
+    struct rdmap_stream_context* ctx = __atomic_load_n(&qp->ctx, __ATOMIC_ACQUIRE);
+    if (ctx == nullptr) {
+        pthread_mutex_lock(&qp->lock);
+        ctx = qp->ctx;
+        int ret = ctx ? 0 : suiw_stash_recv(qp, wr, bad_wr);
+        pthread_mutex_unlock(&qp->lock);
+        if (ctx == nullptr)
+            return ret;
+    }
+    int ret = rdma_post_recv(ctx, *(recv_wr*) wr);
+    if (ret < 0) {
+        *bad_wr = wr;
+        return -ret;
+    }
+    return 0;
+}
+
+static int suiw_poll_cq(ibv_cq *ibcq, int num_entries, ibv_wc *wc) {
+    struct suiw_cq* cq = (struct suiw_cq*) ibcq;
+    return cq->cq->q->try_dequeue_bulk(suiw_wc_out_iter{wc}, num_entries);
+}
+
+/* Extended CQ polling: completions are read through the ibv_cq_ex
+ * accessors straight out of a small batch dequeued from the CQ ring. */
+
+static inline struct suiw_cq* to_suiw_cq(ibv_cq_ex *ibcq) {
+    return (struct suiw_cq*) ibcq;
+}
+
+static inline work_completion* suiw_cq_cur(ibv_cq_ex *ibcq) {
+    struct suiw_cq* cq = to_suiw_cq(ibcq);
+    return &cq->poll_buf[cq->poll_idx];
+}
+
+//! Makes poll_buf[poll_idx] the current completion, refilling if needed
+static int suiw_cq_load(struct suiw_cq* cq) {
+    if (cq->poll_idx >= cq->poll_len) {
+        cq->poll_idx = 0;
+        cq->poll_len = cq->cq->q->try_dequeue_bulk(cq->poll_buf, SUIW_CQ_POLL_BATCH);
+        if (cq->poll_len == 0)
+            return ENOENT;
+    }
+    cq->ex.wr_id = cq->poll_buf[cq->poll_idx].wr_id;
+    cq->ex.status = (enum ibv_wc_status) cq->poll_buf[cq->poll_idx].status;
+    return 0;
+}
+
+static int suiw_start_poll(ibv_cq_ex *ibcq, ibv_poll_cq_attr *attr) {
+    if (attr->comp_mask)
+        return EINVAL;
+    return suiw_cq_load(to_suiw_cq(ibcq));
+}
+
+static int suiw_next_poll(ibv_cq_ex *ibcq) {
+    struct suiw_cq* cq = to_suiw_cq(ibcq);
+    cq->poll_idx++;
+    return suiw_cq_load(cq);
+}
+
+static void suiw_end_poll(ibv_cq_ex *ibcq) {
+    //! The current completion was consumed; the rest stay buffered
+    to_suiw_cq(ibcq)->poll_idx++;
+}
+
+static enum ibv_wc_opcode suiw_wc_read_opcode(ibv_cq_ex *ibcq) {
+    return suiw_wc_opcode(suiw_cq_cur(ibcq)->opcode);
+}
+
+static uint32_t suiw_wc_read_vendor_err(ibv_cq_ex *ibcq) {
+    return suiw_cq_cur(ibcq)->vendor_err;
+}
+
+static uint32_t suiw_wc_read_byte_len(ibv_cq_ex *ibcq) {
+    return suiw_cq_cur(ibcq)->byte_len;
+}
+
+static __be32 suiw_wc_read_imm_data(ibv_cq_ex *ibcq) {
+    return suiw_cq_cur(ibcq)->imm_data;
+}
+
+static uint32_t suiw_wc_read_qp_num(ibv_cq_ex *ibcq) {
+    return suiw_cq_cur(ibcq)->qp_num;
+}
+
+static uint32_t suiw_wc_read_src_qp(ibv_cq_ex *ibcq) {
+    return suiw_cq_cur(ibcq)->src_qp;
+}
+
+static unsigned int suiw_wc_read_wc_flags(ibv_cq_ex *ibcq) {
+    return suiw_cq_cur(ibcq)->wc_flags;
+}
+
+static uint32_t suiw_wc_read_slid(ibv_cq_ex *ibcq) {
+    return 0;
+}
+
+static uint8_t suiw_wc_read_sl(ibv_cq_ex *ibcq) {
+    return 0;
+}
+
+static uint8_t suiw_wc_read_dlid_path_bits(ibv_cq_ex *ibcq) {
+    return 0;
+}
+
+//! In CLOCK_MONOTONIC_RAW nanoseconds rather than device clock cycles
+static uint64_t suiw_wc_read_completion_ts(ibv_cq_ex *ibcq) {
+    return suiw_cq_cur(ibcq)->completion_ts;
+}
+
+/* Extended QP posting: the ibv_wr_* builder writes each WR directly in the
+ * form rnic_send consumes, and ibv_wr_complete hands the whole batch to
+ * the SQ ring with one bulk enqueue. */
+
+static inline struct suiw_qp* to_suiw_qp(ibv_qp_ex *ibqp) {
+    return (struct suiw_qp*) ibqp;
+}
+
+//! Opens the next WR of the batch, or returns NULL once the batch failed
+static struct send_wr* suiw_wr_new(ibv_qp_ex *ibqp, enum rdma_opcode opcode) {
+    struct suiw_qp* qp = to_suiw_qp(ibqp);
+    if (qp->batch_err)
+        return nullptr;
+    if (qp->batch_len == qp->batch_cap) {
+        qp->batch_err = ENOMEM;
+        return nullptr;
+    }
+    struct send_wr* wr = &qp->batch[qp->batch_len++];
+    wr->wr_id = ibqp->wr_id;
+    wr->next = NULL;
+    wr->sg_list = NULL;
+    wr->num_sge = 0;
+    wr->send_flags = ibqp->wr_flags;
+    if (opcode == RDMAP_SEND && (ibqp->wr_flags & IBV_SEND_SOLICITED))
+        opcode = RDMAP_SEND_SE;
+    else if (opcode == RDMAP_SEND_IMM && (ibqp->wr_flags & IBV_SEND_SOLICITED))
+        opcode = RDMAP_SEND_SE_IMM;
+    else if (opcode == RDMAP_SEND_INVAL && (ibqp->wr_flags & IBV_SEND_SOLICITED))
+        opcode = RDMAP_SEND_SE_INVAL;
+    wr->opcode = opcode;
+    return wr;
+}
+
+//! The WR the ibv_wr_set_* calls apply to
+static struct send_wr* suiw_wr_cur(ibv_qp_ex *ibqp) {
+    struct suiw_qp* qp = to_suiw_qp(ibqp);
+    if (qp->batch_err)
+        return nullptr;
+    if (qp->batch_len == 0) {
+        qp->batch_err = EINVAL;
+        return nullptr;
+    }
+    return &qp->batch[qp->batch_len - 1];
+}
+
+static void suiw_wr_fail(ibv_qp_ex *ibqp, int err) {
+    struct suiw_qp* qp = to_suiw_qp(ibqp);
+    if (!qp->batch_err)
+        qp->batch_err = err;
+}
+
+static void suiw_wr_atomic_cmp_swp(ibv_qp_ex *ibqp, uint32_t rkey, uint64_t remote_addr,
+                                   uint64_t compare, uint64_t swap) {
+    struct send_wr* wr = suiw_wr_new(ibqp, RDMAP_ATOMIC_CMP_SWP);
+    if (!wr)
+        return;
+    wr->wr.atomic.remote_addr = remote_addr;
+    wr->wr.atomic.compare_add = compare;
+    wr->wr.atomic.swap = swap;
+    wr->wr.atomic.rkey = rkey;
+}
+
+static void suiw_wr_atomic_fetch_add(ibv_qp_ex *ibqp, uint32_t rkey, uint64_t remote_addr,
+                                     uint64_t add) {
+    struct send_wr* wr = suiw_wr_new(ibqp, RDMAP_ATOMIC_FETCH_ADD);
+    if (!wr)
+        return;
+    wr->wr.atomic.remote_addr = remote_addr;
+    wr->wr.atomic.compare_add = add;
+    wr->wr.atomic.rkey = rkey;
+}
+
+static void suiw_wr_rdma(ibv_qp_ex *ibqp, enum rdma_opcode opcode, uint32_t rkey,
+                         uint64_t remote_addr, __be32 imm_data) {
+    struct send_wr* wr = suiw_wr_new(ibqp, opcode);
+    if (!wr)
+        return;
+    wr->wr.rdma.remote_addr = remote_addr;
+    wr->wr.rdma.rkey = rkey;
+    wr->imm_data = imm_data;
+}
+
+static void suiw_wr_rdma_read(ibv_qp_ex *ibqp, uint32_t rkey, uint64_t remote_addr) {
+    suiw_wr_rdma(ibqp, RDMAP_RDMA_READ_REQ, rkey, remote_addr, 0);
+}
+
+static void suiw_wr_rdma_write(ibv_qp_ex *ibqp, uint32_t rkey, uint64_t remote_addr) {
+    suiw_wr_rdma(ibqp, RDMAP_RDMA_WRITE, rkey, remote_addr, 0);
+}
+
+static void suiw_wr_rdma_write_imm(ibv_qp_ex *ibqp, uint32_t rkey, uint64_t remote_addr,
+                                   __be32 imm_data) {
+    suiw_wr_rdma(ibqp, RDMAP_RDMA_WRITE_IMM, rkey, remote_addr, imm_data);
+}
+
+static void suiw_wr_send(ibv_qp_ex *ibqp) {
+    suiw_wr_new(ibqp, RDMAP_SEND);
+}
+
+static void suiw_wr_send_imm(ibv_qp_ex *ibqp, __be32 imm_data) {
+    struct send_wr* wr = suiw_wr_new(ibqp, RDMAP_SEND_IMM);
+    if (wr)
+        wr->imm_data = imm_data;
+}
+
+static void suiw_wr_send_inv(ibv_qp_ex *ibqp, uint32_t invalidate_rkey) {
+    struct send_wr* wr = suiw_wr_new(ibqp, RDMAP_SEND_INVAL);
+    if (wr)
+        wr->invalidate_rkey = invalidate_rkey;
+}
+
+static void suiw_wr_set_inline_data_list(ibv_qp_ex *ibqp, size_t num_buf,
+                                         const ibv_data_buf *buf_list);
+
+//! With IBV_SEND_INLINE in wr_flags the payload is gathered right away,
+//! like ibv_wr_set_inline_data_list does
+static void suiw_wr_set_sge_list(ibv_qp_ex *ibqp, size_t num_sge, const ibv_sge *sg_list) {
+    struct send_wr* wr = suiw_wr_cur(ibqp);
+    if (!wr)
+        return;
+    if (num_sge > SIW_MAX_SGE) {
+        suiw_wr_fail(ibqp, EINVAL);
+        return;
+    }
+    if (wr->send_flags & SEND_INLINE) {
+        ibv_data_buf buf_list[SIW_MAX_SGE];
+        for (size_t i = 0; i < num_sge; i++) {
+            buf_list[i].addr = (void*) sg_list[i].addr;
+            buf_list[i].length = sg_list[i].length;
+        }
+        suiw_wr_set_inline_data_list(ibqp, num_sge, buf_list);
+        return;
+    }
+    memcpy(wr->sge, sg_list, num_sge * sizeof(struct sge));
+    wr->num_sge = num_sge;
+}
+
+static void suiw_wr_set_sge(ibv_qp_ex *ibqp, uint32_t lkey, uint64_t addr, uint32_t length) {
+    ibv_sge sge = { addr, length, lkey };
+    suiw_wr_set_sge_list(ibqp, 1, &sge);
+}
+
+//! Gathers the buffers into sge[1..], as rdmap_prep_send_wr does for
+//! SEND_INLINE, so they can be reused on return
+static void suiw_wr_set_inline_data_list(ibv_qp_ex *ibqp, size_t num_buf,
+                                         const ibv_data_buf *buf_list) {
+    struct send_wr* wr = suiw_wr_cur(ibqp);
+    if (!wr)
+        return;
+    size_t len = 0;
+    for (size_t i = 0; i < num_buf; i++)
+        len += buf_list[i].length;
+    if (len > SIW_MAX_INLINE) {
+        suiw_wr_fail(ibqp, EINVAL);
+        return;
+    }
+    char* data = (char*) &wr->sge[1];
+    len = 0;
+    for (size_t i = 0; i < num_buf; i++) {
+        memcpy(data + len, buf_list[i].addr, buf_list[i].length);
+        len += buf_list[i].length;
+    }
+    wr->sge[0].length = len;
+    wr->sge[0].lkey = 0;
+    wr->num_sge = 1;
+    wr->send_flags |= SEND_INLINE;
+}
+
+static void suiw_wr_set_inline_data(ibv_qp_ex *ibqp, void *addr, size_t length) {
+    ibv_data_buf buf = { addr, length };
+    suiw_wr_set_inline_data_list(ibqp, 1, &buf);
+}
+
+static void suiw_wr_start(ibv_qp_ex *ibqp) {
+    struct suiw_qp* qp = to_suiw_qp(ibqp);
+    qp->batch_len = 0;
+    qp->batch_err = 0;
+}
+
+static void suiw_wr_abort(ibv_qp_ex *ibqp) {
+    to_suiw_qp(ibqp)->batch_len = 0;
+}
+
+static int suiw_wr_complete(ibv_qp_ex *ibqp) {
+    struct suiw_qp* qp = to_suiw_qp(ibqp);
+    uint32_t num_wrs = qp->batch_len;
+    qp->batch_len = 0;
+    struct rdmap_stream_context* ctx = __atomic_load_n(&qp->ctx, __ATOMIC_ACQUIRE);
+    if (qp->batch_err)
+        return qp->batch_err;
+    if (ctx == nullptr)
+        return ENOTCONN;
+
+    for (uint32_t i = 0; i < num_wrs; i++) {
+        //! rdmap_check_send_wr reads the SGEs through sg_list
+        struct send_wr* wr = &qp->batch[i];
+        wr->sg_list = wr->sge;
+        int ret = rdmap_check_send_wr(ctx, wr);
+        wr->sg_list = NULL;
+        if (ret < 0)
+            return -ret;
+    }
+    if (num_wrs && !qp->sq->send_q->enqueue_bulk(qp->batch, num_wrs))
+        return ENOMEM;
+    return 0;
+}
+
+static ibv_cq_ex *suiw_create_cq_ex(ibv_context *context, ibv_cq_init_attr_ex *cq_attr) {
+    if (cq_attr->comp_mask || (cq_attr->wc_flags & ~(uint64_t) (IBV_WC_STANDARD_FLAGS |
+                                                               IBV_WC_EX_WITH_COMPLETION_TIMESTAMP))) {
+        errno = EOPNOTSUPP;
+        return nullptr;
+    }
+    struct suiw_cq* cq = (struct suiw_cq*) malloc(sizeof(struct suiw_cq));
+    memset(cq, 0, sizeof(struct suiw_cq));
+    cq->ex.context = context;
+    cq->ex.channel = cq_attr->channel;
+    cq->ex.cq_context = cq_attr->cq_context;
+    cq->ex.cqe = cq_attr->cqe;
+    cq->ex.start_poll = suiw_start_poll;
+    cq->ex.next_poll = suiw_next_poll;
+    cq->ex.end_poll = suiw_end_poll;
+    cq->ex.read_opcode = suiw_wc_read_opcode;
+    cq->ex.read_vendor_err = suiw_wc_read_vendor_err;
+    cq->ex.read_byte_len = suiw_wc_read_byte_len;
+    cq->ex.read_imm_data = suiw_wc_read_imm_data;
+    cq->ex.read_qp_num = suiw_wc_read_qp_num;
+    cq->ex.read_src_qp = suiw_wc_read_src_qp;
+    cq->ex.read_wc_flags = suiw_wc_read_wc_flags;
+    cq->ex.read_slid = suiw_wc_read_slid;
+    cq->ex.read_sl = suiw_wc_read_sl;
+    cq->ex.read_dlid_path_bits = suiw_wc_read_dlid_path_bits;
+    cq->cq = create_cq(NULL, cq_attr->cqe);
+    if (cq_attr->wc_flags & IBV_WC_EX_WITH_COMPLETION_TIMESTAMP) {
+        cq->ex.read_completion_ts = suiw_wc_read_completion_ts;
+        cq->cq->timestamps = 1;
+    }
+    return &cq->ex;
+}
+
+//! ibv_wr_* opcodes the SoftUiWarp SQ can carry
+static const uint64_t suiw_send_ops_flags =
+    IBV_QP_EX_WITH_RDMA_WRITE | IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM |
+    IBV_QP_EX_WITH_SEND | IBV_QP_EX_WITH_SEND_WITH_IMM | IBV_QP_EX_WITH_SEND_WITH_INV |
+    IBV_QP_EX_WITH_RDMA_READ | IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP |
+    IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD;
+
+static ibv_qp *suiw_create_qp_ex(ibv_context *context, ibv_qp_init_attr_ex *qp_init_attr) {
+    bool send_ops = qp_init_attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+    if (!(qp_init_attr->comp_mask & IBV_QP_INIT_ATTR_PD) ||
+        (qp_init_attr->comp_mask & ~(IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_SEND_OPS_FLAGS)) ||
+        (send_ops && (qp_init_attr->send_ops_flags & ~suiw_send_ops_flags))) {
+        errno = EOPNOTSUPP;
+        return nullptr;
+    }
+    if (qp_init_attr->qp_type != IBV_QPT_RC || qp_init_attr->srq != nullptr ||
+        qp_init_attr->cap.max_send_sge > SIW_MAX_SGE || qp_init_attr->cap.max_recv_sge > RDMAP_MAX_RECV_SGE) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    struct suiw_pd* pd = (struct suiw_pd*) qp_init_attr->pd;
+
+    struct suiw_qp* qp = (struct suiw_qp*) malloc(sizeof(struct suiw_qp));
+    memset(qp, 0, sizeof(struct suiw_qp));
+    qp->ibv.context = context;
+    qp->ibv.qp_context = qp_init_attr->qp_context;
+    qp->ibv.pd = qp_init_attr->pd;
+    qp->ibv.send_cq = qp_init_attr->send_cq;
+    qp->ibv.recv_cq = qp_init_attr->recv_cq;
+    qp->ibv.qp_num = next_qp_num++;
+    qp->ibv.qp_type = qp_init_attr->qp_type;
+    qp->ibv.state = IBV_QPS_RESET;
+    qp->max_send_wr = qp_init_attr->cap.max_send_wr;
+    pthread_mutex_init(&qp->lock, NULL);
+    qp->early_cap = qp_init_attr->cap.max_recv_wr;
+    qp->early_recvs = (struct suiw_recv_slot*) malloc(sizeof(struct suiw_recv_slot) * qp->early_cap);
+
+    if (send_ops) {
+        //! A batch can never hold more than the SQ does
+        qp->batch_cap = qp_init_attr->cap.max_send_wr;
+        qp->batch = (struct send_wr*) malloc(sizeof(struct send_wr) * qp->batch_cap);
+        qp->ex.wr_atomic_cmp_swp = suiw_wr_atomic_cmp_swp;
+        qp->ex.wr_atomic_fetch_add = suiw_wr_atomic_fetch_add;
+        qp->ex.wr_rdma_read = suiw_wr_rdma_read;
+        qp->ex.wr_rdma_write = suiw_wr_rdma_write;
+        qp->ex.wr_rdma_write_imm = suiw_wr_rdma_write_imm;
+        qp->ex.wr_send = suiw_wr_send;
+        qp->ex.wr_send_imm = suiw_wr_send_imm;
+        qp->ex.wr_send_inv = suiw_wr_send_inv;
+        qp->ex.wr_set_inline_data = suiw_wr_set_inline_data;
+        qp->ex.wr_set_inline_data_list = suiw_wr_set_inline_data_list;
+        qp->ex.wr_set_sge = suiw_wr_set_sge;
+        qp->ex.wr_set_sge_list = suiw_wr_set_sge_list;
+        qp->ex.wr_start = suiw_wr_start;
+        qp->ex.wr_complete = suiw_wr_complete;
+        qp->ex.wr_abort = suiw_wr_abort;
+    }
+
+    struct wq_init_attr attr;
+    attr.wq_type = WQT_SQ;
+    attr.max_wr = qp_init_attr->cap.max_send_wr;
+    attr.max_sge = qp_init_attr->cap.max_send_sge;
+    attr.pd = &pd->pd;
+    attr.cq = ((struct suiw_cq*) qp_init_attr->send_cq)->cq;
+    qp->sq = create_wq(NULL, &attr);
+
+    attr.wq_type = WQT_RQ;
+    attr.max_wr = qp_init_attr->cap.max_recv_wr;
+    attr.max_sge = qp_init_attr->cap.max_recv_sge;
+    attr.cq = ((struct suiw_cq*) qp_init_attr->recv_cq)->cq;
+    qp->rq = create_wq(NULL, &attr);
+    return &qp->ibv;
+}
+
+/*
+ * Starts the data path of `qp` on an MPA-connected socket, then hands it
+ * the receives posted so far.
+ *  returns: 0 on success, -1 if the stream could not be set up.
+ */
+static int suiw_qp_connect(struct suiw_qp* qp, int sockfd, int suiw_ext, int responder_resources) {
+    struct rdmap_stream_init_attr attr;
+    attr.sockfd = sockfd;
+    attr.pd = &((struct suiw_pd*) qp->ibv.pd)->pd;
+    attr.send_q = qp->sq;
+    attr.recv_q = qp->rq;
+    attr.max_pending_read_requests = responder_resources ? responder_resources : qp->max_send_wr + 2;
+    attr.suiw_ext = suiw_ext;
+
+    pthread_mutex_lock(&qp->lock);
+    struct rdmap_stream_context* ctx = rdmap_init_stream(&attr);
+    if (ctx == nullptr) {
+        pthread_mutex_unlock(&qp->lock);
+        return -1;
+    }
+    qp->sq->context = ctx;
+    qp->rq->context = ctx;
+    if (qp->early_len) {
+        for (uint32_t i = 0; i + 1 < qp->early_len; i++)
+            qp->early_recvs[i].wr.next = &qp->early_recvs[i + 1].wr;
+        rdma_post_recv(ctx, qp->early_recvs[0].wr);
+        qp->early_len = 0;
+    }
+    qp->ibv.state = IBV_QPS_RTS;
+    __atomic_store_n(&qp->ctx, ctx, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&qp->lock);
+    return 0;
+}
+
+static void suiw_qp_disconnect(struct suiw_qp* qp) {
+    pthread_mutex_lock(&qp->lock);
+    struct rdmap_stream_context* ctx = qp->ctx;
+    __atomic_store_n(&qp->ctx, (struct rdmap_stream_context*) NULL, __ATOMIC_RELEASE);
+    if (ctx != nullptr) {
+        rdmap_kill_stream(ctx);
+        free(ctx);
+    }
+    qp->sq->context = NULL;
+    qp->rq->context = NULL;
+    qp->ibv.state = IBV_QPS_ERR;
+    pthread_mutex_unlock(&qp->lock);
+}
+
+/* Connection manager: one thread drives every non-blocking TCP connect,
+ * accept and MPA handshake from an edge-triggered epoll set, and reports
+ * progress as rdma_cm events on the id's event channel. */
+
+enum suiw_cm_state {
+    SUIW_CM_IDLE,
+    SUIW_CM_LISTEN,
+    //! Active side, TCP connect in flight
+    SUIW_CM_CONNECT,
+    //! MPA request/reply exchange in flight
+    SUIW_CM_MPA,
+    //! Passive side, CONNECT_REQUEST raised, waiting for accept/reject
+    SUIW_CM_REQ,
+    SUIW_CM_ESTABLISHED,
+    SUIW_CM_CLOSED,
+};
+
+//! Event channel: the CM thread queues events in-process and counts them
+//! on an eventfd, which is the public fd so it can be polled as usual
+struct suiw_event_channel {
+    rdma_event_channel ch;
+    pthread_mutex_t lock;
+    std::deque<rdma_cm_event> events;
+    //! Signalled on every queued event, for rdma_get_request
+    pthread_cond_t cond;
+    //! Events rdma_get_request took out of order whose eventfd count
+    //! rdma_get_cm_event still has to skip
+    uint32_t taken;
+    //! Device context shared by every id created on this channel
+    ibv_context *verbs;
+};
+
+struct suiw_cm_id {
+    rdma_cm_id id;
+    pthread_mutex_t lock;
+    enum suiw_cm_state state;
+    //! Connected or listening TCP socket, -1 if none
+    int fd;
+    //! Passive side: the id rdma_listen was called on
+    rdma_cm_id *listen_id;
+    //! Passive side: the reply being sent rejects the request
+    int rejecting;
+    //! PD allocated by rdma_create_qp when none was given
+    int own_pd;
+    uint8_t responder_resources;
+    struct mpa_handshake hs;
+};
+
+static int cm_epfd = -1;
+static pthread_once_t cm_once = PTHREAD_ONCE_INIT;
+
+static inline struct suiw_cm_id* to_suiw_cm_id(rdma_cm_id *id) {
+    return (struct suiw_cm_id*) id;
+}
+
+static socklen_t suiw_sockaddr_len(const struct sockaddr *addr) {
+    return addr->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+}
+
+//! Queues an event on the id's channel
+static int suiw_cm_event(struct suiw_cm_id *cm, enum rdma_cm_event_type type, int status,
+                         const void *pdata, uint8_t pd_len) {
+    rdma_cm_event event;
+    bzero(&event, sizeof(rdma_cm_event));
+    event.event = type;
+    event.id = &cm->id;
+    event.listen_id = cm->listen_id;
+    event.status = status;
+    event.param.conn.private_data = pdata;
+    event.param.conn.private_data_len = pd_len;
+
+    struct suiw_event_channel *ec = (struct suiw_event_channel*) cm->id.channel;
+    pthread_mutex_lock(&ec->lock);
+    ec->events.push_back(event);
+    pthread_cond_broadcast(&ec->cond);
+    pthread_mutex_unlock(&ec->lock);
+    uint64_t one = 1;
+    return write(ec->ch.fd, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+}
+
+static struct suiw_cm_id *suiw_cm_alloc(rdma_event_channel *channel, ibv_context *verbs,
+                                        void *context, enum rdma_port_space ps) {
+    struct suiw_cm_id *cm = (struct suiw_cm_id*) malloc(sizeof(struct suiw_cm_id));
+    memset(cm, 0, sizeof(struct suiw_cm_id));
+    cm->id.channel = channel;
+    cm->id.verbs = verbs;
+    cm->id.context = context;
+    cm->id.ps = ps;
+    cm->id.qp_type = IBV_QPT_RC;
+    cm->fd = -1;
+    cm->state = SUIW_CM_IDLE;
+    pthread_mutex_init(&cm->lock, NULL);
+    return cm;
+}
+
+//! Drops the socket of a connection that never got established
+static void suiw_cm_close(struct suiw_cm_id *cm) {
+    if (cm->fd >= 0) {
+        epoll_ctl(cm_epfd, EPOLL_CTL_DEL, cm->fd, NULL);
+        close(cm->fd);
+        cm->fd = -1;
+    }
+    cm->state = SUIW_CM_CLOSED;
+}
+
+//! MPA is done: the socket leaves the CM and goes to the RDMAP threads
+static void suiw_cm_establish(struct suiw_cm_id *cm) {
+    epoll_ctl(cm_epfd, EPOLL_CTL_DEL, cm->fd, NULL);
+    fcntl(cm->fd, F_SETFL, fcntl(cm->fd, F_GETFL) & ~O_NONBLOCK);
+    if (suiw_qp_connect((struct suiw_qp*) cm->id.qp, cm->fd, mpa_handshake_suiw_ext(&cm->hs),
+                        cm->responder_resources)) {
+        suiw_cm_close(cm);
+        suiw_cm_event(cm, RDMA_CM_EVENT_CONNECT_ERROR, -ENOMEM, NULL, 0);
+        return;
+    }
+    cm->state = SUIW_CM_ESTABLISHED;
+    if (cm->hs.is_client)
+        suiw_cm_event(cm, RDMA_CM_EVENT_ESTABLISHED, 0, cm->hs.pdata, mpa_handshake_pd_len(&cm->hs));
+    else
+        suiw_cm_event(cm, RDMA_CM_EVENT_ESTABLISHED, 0, NULL, 0);
+}
+
+/*
+ * Advances a connecting id as far as its socket allows. Called with cm->lock held.
+ *  returns: 1 if the id was never reported to the user and should be freed.
+ */
+static int suiw_cm_progress(struct suiw_cm_id *cm) {
+    if (cm->state == SUIW_CM_CONNECT) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(cm->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            suiw_cm_close(cm);
+            suiw_cm_event(cm, RDMA_CM_EVENT_UNREACHABLE, -err, NULL, 0);
+            return 0;
+        }
+        cm->state = SUIW_CM_MPA;
+    }
+    if (cm->state != SUIW_CM_MPA && cm->state != SUIW_CM_REQ)
+        return 0;
+
+    int ret = mpa_handshake_progress(&cm->hs);
+    if (ret < 0) {
+        suiw_cm_close(cm);
+        //! A passive id nobody has seen yet just goes away
+        if (!cm->hs.is_client && cm->state == SUIW_CM_MPA)
+            return 1;
+        suiw_cm_event(cm, RDMA_CM_EVENT_CONNECT_ERROR, ret, NULL, 0);
+        return 0;
+    }
+    switch (ret) {
+        case MPA_HS_REQ_RCVD:
+            if (cm->state == SUIW_CM_MPA) {
+                cm->state = SUIW_CM_REQ;
+                suiw_cm_event(cm, RDMA_CM_EVENT_CONNECT_REQUEST, 0, cm->hs.pdata,
+                              mpa_handshake_pd_len(&cm->hs));
+            }
+            break;
+        case MPA_HS_REJECTED:
+            suiw_cm_close(cm);
+            suiw_cm_event(cm, RDMA_CM_EVENT_REJECTED, ECONNREFUSED, cm->hs.pdata,
+                          mpa_handshake_pd_len(&cm->hs));
+            break;
+        case MPA_HS_DONE:
+            if (cm->rejecting)
+                suiw_cm_close(cm);
+            else
+                suiw_cm_establish(cm);
+            break;
+    }
+    return 0;
+}
+
+//! Takes every pending connection off a listening socket
+static void suiw_cm_accept(struct suiw_cm_id *listener) {
+    for (;;) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        int fd = accept4(listener->fd, (struct sockaddr*) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+        struct suiw_cm_id *cm = suiw_cm_alloc(listener->id.channel, listener->id.verbs,
+                                              listener->id.context, listener->id.ps);
+        cm->listen_id = &listener->id;
+        cm->fd = fd;
+        memcpy(&cm->id.route.addr.dst_storage, &addr, len);
+        len = sizeof(cm->id.route.addr.src_storage);
+        getsockname(fd, &cm->id.route.addr.src_addr, &len);
+        mpa_handshake_init(&cm->hs, fd, 0, NULL, 0);
+        cm->state = SUIW_CM_MPA;
+
+        //! Adding reports readiness that is already there, so a request
+        //! that arrived with the SYN is not missed
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = cm;
+        epoll_ctl(cm_epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void *suiw_cm_loop(void *arg) {
+    struct epoll_event events[64];
+    for (;;) {
+        int n = epoll_wait(cm_epfd, events, 64, -1);
+        for (int i = 0; i < n; i++) {
+            struct suiw_cm_id *cm = (struct suiw_cm_id*) events[i].data.ptr;
+            if (cm->state == SUIW_CM_LISTEN) {
+                suiw_cm_accept(cm);
+                continue;
+            }
+            pthread_mutex_lock(&cm->lock);
+            int dead = suiw_cm_progress(cm);
+            pthread_mutex_unlock(&cm->lock);
+            if (dead) {
+                pthread_mutex_destroy(&cm->lock);
+                free(cm);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void suiw_cm_start() {
+    cm_epfd = epoll_create1(EPOLL_CLOEXEC);
+    pthread_t thread;
+    pthread_create(&thread, NULL, suiw_cm_loop, NULL);
+    pthread_detach(thread);
+}
+
+static int suiw_cm_watch(struct suiw_cm_id *cm, uint32_t events) {
+    pthread_once(&cm_once, suiw_cm_start);
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = cm;
+    return epoll_ctl(cm_epfd, EPOLL_CTL_ADD, cm->fd, &ev);
+}
+
 /* Implementation of public API. */
 
 ibv_device *suiw_get_ibv_device() {
@@ -86,9 +1006,18 @@ bool suiw_is_device_softuiwarp(ibv_device* device) {
 ibv_context *suiw_open_device(ibv_device *device) {
     if (device == nullptr)
         return nullptr;
-    ibv_context *context = (ibv_context*) malloc(sizeof(ibv_context));
-    memset(context, 0, sizeof(ibv_context));
+    // Extended so that ibv_create_cq_ex/ibv_create_qp_ex reach us
+    verbs_context *vctx = (verbs_context*) malloc(sizeof(verbs_context));
+    memset(vctx, 0, sizeof(verbs_context));
+    vctx->sz = sizeof(verbs_context);
+    vctx->create_cq_ex = suiw_create_cq_ex;
+    vctx->create_qp_ex = suiw_create_qp_ex;
+    ibv_context *context = &vctx->context;
+    context->abi_compat = __VERBS_ABI_IS_EXTENDED;
     context->device = device;
+    context->ops.post_send = suiw_post_send;
+    context->ops.post_recv = suiw_post_recv;
+    context->ops.poll_cq = suiw_poll_cq;
     // TODO there may be some more initialization to do here
     return context;
 }
@@ -96,7 +1025,7 @@ ibv_context *suiw_open_device(ibv_device *device) {
 int suiw_close_device(ibv_context *context) {
     if (context == nullptr)
         return 0;
-    free(context);
+    free(verbs_get_ctx(context));
     return 0;
 }
 
@@ -108,65 +1037,296 @@ int suiw_query_device(struct ibv_context *context, struct ibv_device_attr *devic
     return -1;
 }
 
+ibv_pd *suiw_alloc_pd(ibv_context *context) {
+    struct suiw_pd* pd = (struct suiw_pd*) malloc(sizeof(struct suiw_pd));
+    memset(pd, 0, sizeof(struct suiw_pd));
+    pd->ibv.context = context;
+    pd->ibv.handle = pd->pd.pd_id = next_pd_id++;
+    return &pd->ibv;
+}
+
+int suiw_dealloc_pd(ibv_pd *pd) {
+    free(pd);
+    return 0;
+}
+
+ibv_cq *suiw_create_cq(ibv_context *context, int cqe, void *cq_context) {
+    ibv_cq_init_attr_ex attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.cqe = cqe;
+    attr.cq_context = cq_context;
+    attr.wc_flags = IBV_WC_STANDARD_FLAGS;
+    return ibv_cq_ex_to_cq(suiw_create_cq_ex(context, &attr));
+}
+
+int suiw_destroy_cq(ibv_cq *ibcq) {
+    struct suiw_cq* cq = (struct suiw_cq*) ibcq;
+    destroy_cq(cq->cq);
+    free(cq);
+    return 0;
+}
+
+ibv_qp_ex *suiw_qp_to_qp_ex(ibv_qp *ibqp) {
+    struct suiw_qp* qp = (struct suiw_qp*) ibqp;
+    return qp->batch != nullptr ? &qp->ex : nullptr;
+}
+
+ibv_qp *suiw_create_qp(ibv_pd *pd, ibv_qp_init_attr *qp_init_attr) {
+    ibv_qp_init_attr_ex attr;
+    memset(&attr, 0, sizeof(attr));
+    memcpy(&attr, qp_init_attr, sizeof(*qp_init_attr));
+    attr.comp_mask = IBV_QP_INIT_ATTR_PD;
+    attr.pd = pd;
+    return suiw_create_qp_ex(pd->context, &attr);
+}
+
+int suiw_destroy_qp(ibv_qp *ibqp) {
+    struct suiw_qp* qp = (struct suiw_qp*) ibqp;
+    if (qp->ctx != nullptr)
+        return EBUSY;
+    destroy_wq(qp->sq);
+    destroy_wq(qp->rq);
+    pthread_mutex_destroy(&qp->lock);
+    free(qp->early_recvs);
+    free(qp->batch);
+    free(qp);
+    return 0;
+}
+
 rdma_event_channel *suiw_create_event_channel() {
-    daemon_msg msg;
-    msg.type = DAEMON_CREATE_EC;
-    send(dfd, &msg, sizeof(msg), 0);
-    printf("connecting to daemon\n");
-    int ec_fd = connect_to_daemon();
-    rdma_event_channel *result = (rdma_event_channel*) malloc(sizeof(rdma_event_channel));
-    result->fd = ec_fd;
-    return result;
+    int fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+    if (fd == -1)
+        return nullptr;
+    struct suiw_event_channel *result = new suiw_event_channel();
+    result->ch.fd = fd;
+    pthread_mutex_init(&result->lock, NULL);
+    pthread_cond_init(&result->cond, NULL);
+    result->verbs = suiw_open_device(suiw_ibv_device);
+    return &result->ch;
 }
 
 void suiw_destroy_event_channel(rdma_event_channel *channel) {
-    shutdown(channel->fd, SHUT_RDWR);
-    close(channel->fd);
-    free(channel);
+    struct suiw_event_channel *ec = (struct suiw_event_channel*) channel;
+    suiw_close_device(ec->verbs);
+    close(ec->ch.fd);
+    pthread_cond_destroy(&ec->cond);
+    pthread_mutex_destroy(&ec->lock);
+    delete ec;
 }
 
 int suiw_create_id(struct rdma_event_channel *channel,
 		   struct rdma_cm_id **id, void *context,
 		   enum rdma_port_space ps) {
-    rdma_cm_id *result = (rdma_cm_id*) malloc(sizeof(rdma_cm_id));
-    result->channel = channel;
-    result->verbs = suiw_open_device(suiw_ibv_device);
-    result->context = context;
-    // TODO some other initialization may be necessary here
-    *id = result;
+    struct suiw_event_channel *ec = (struct suiw_event_channel*) channel;
+    struct suiw_cm_id *result = suiw_cm_alloc(channel, ec->verbs, context, ps);
+    *id = &result->id;
     return 0;
 }
 
 int suiw_destroy_id(struct rdma_cm_id *id) {
-    free(id);
+    struct suiw_cm_id *cm = to_suiw_cm_id(id);
+    pthread_mutex_lock(&cm->lock);
+    if (cm->state == SUIW_CM_ESTABLISHED)
+        close(cm->fd);
+    else
+        suiw_cm_close(cm);
+    if (cm->own_pd)
+        suiw_dealloc_pd(id->pd);
+    pthread_mutex_unlock(&cm->lock);
+    pthread_mutex_destroy(&cm->lock);
+    free(cm);
+    return 0;
+}
+
+int suiw_bind_addr(struct rdma_cm_id *id, struct sockaddr *addr) {
+    memcpy(&id->route.addr.src_storage, addr, suiw_sockaddr_len(addr));
     return 0;
 }
 
 int suiw_resolve_addr(struct rdma_cm_id *id, struct sockaddr *src_addr,
 		    struct sockaddr *dst_addr, int timeout_ms) {
-    rdma_cm_event event;
-    bzero(&event, sizeof(rdma_cm_event));
-    event.event = RDMA_CM_EVENT_ADDR_RESOLVED;
-    event.id = id;
-    int ret = send(id->channel->fd, &event, sizeof(rdma_cm_event), 0);
-    return ret == sizeof(rdma_cm_event) ? 0 : -1;
+    if (src_addr)
+        suiw_bind_addr(id, src_addr);
+    memcpy(&id->route.addr.dst_storage, dst_addr, suiw_sockaddr_len(dst_addr));
+    return suiw_cm_event(to_suiw_cm_id(id), RDMA_CM_EVENT_ADDR_RESOLVED, 0, NULL, 0);
 }
 
 int suiw_resolve_route(struct rdma_cm_id *id, int timeout_ms) {
-    rdma_cm_event event;
-    bzero(&event, sizeof(rdma_cm_event));
-    event.event = RDMA_CM_EVENT_ROUTE_RESOLVED;
-    event.id = id;
-    int ret = send(id->channel->fd, &event, sizeof(rdma_cm_event), 0);
-    return ret == sizeof(rdma_cm_event) ? 0 : -1;
+    return suiw_cm_event(to_suiw_cm_id(id), RDMA_CM_EVENT_ROUTE_RESOLVED, 0, NULL, 0);
+}
+
+int suiw_cm_create_qp(struct rdma_cm_id *id, struct ibv_pd *pd,
+                      struct ibv_qp_init_attr *qp_init_attr) {
+    struct suiw_cm_id *cm = to_suiw_cm_id(id);
+    if (pd == nullptr) {
+        pd = suiw_alloc_pd(id->verbs);
+        cm->own_pd = 1;
+    }
+    ibv_qp *qp = suiw_create_qp(pd, qp_init_attr);
+    if (qp == nullptr) {
+        if (cm->own_pd)
+            suiw_dealloc_pd(pd);
+        cm->own_pd = 0;
+        return -1;
+    }
+    id->pd = pd;
+    id->qp = qp;
+    id->send_cq = qp_init_attr->send_cq;
+    id->recv_cq = qp_init_attr->recv_cq;
+    return 0;
+}
+
+void suiw_cm_destroy_qp(struct rdma_cm_id *id) {
+    if (id->qp == nullptr)
+        return;
+    suiw_qp_disconnect((struct suiw_qp*) id->qp);
+    suiw_destroy_qp(id->qp);
+    id->qp = NULL;
+}
+
+int suiw_connect(struct rdma_cm_id *id, struct rdma_conn_param *conn_param) {
+    struct suiw_cm_id *cm = to_suiw_cm_id(id);
+    //! iWARP moves straight to RTS, so the QP has to exist already
+    if (id->qp == nullptr || cm->state != SUIW_CM_IDLE) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct sockaddr *dst = &id->route.addr.dst_addr;
+    int fd = socket(dst->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (connect(fd, dst, suiw_sockaddr_len(dst)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&cm->lock);
+    cm->fd = fd;
+    cm->state = SUIW_CM_CONNECT;
+    cm->responder_resources = conn_param ? conn_param->responder_resources : 0;
+    mpa_handshake_init(&cm->hs, fd, 1, conn_param ? conn_param->private_data : NULL,
+                       conn_param ? conn_param->private_data_len : 0);
+    //! Connect completion shows up as writability
+    int ret = suiw_cm_watch(cm, EPOLLIN | EPOLLOUT | EPOLLET);
+    pthread_mutex_unlock(&cm->lock);
+    return ret;
+}
+
+int suiw_listen(struct rdma_cm_id *id, int backlog) {
+    struct suiw_cm_id *cm = to_suiw_cm_id(id);
+    struct sockaddr *src = &id->route.addr.src_addr;
+    int family = src->sa_family == AF_INET6 ? AF_INET6 : AF_INET;
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int flag = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    if (bind(fd, src, suiw_sockaddr_len(src)) < 0 || listen(fd, backlog > 0 ? backlog : SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    cm->fd = fd;
+    cm->state = SUIW_CM_LISTEN;
+    return suiw_cm_watch(cm, EPOLLIN | EPOLLET);
+}
+
+/*
+ * Takes the next connection request for `listen` off its channel. Events
+ * for other ids, such as the ones accepted earlier, stay queued in order.
+ */
+int suiw_get_request(struct rdma_cm_id *listen, struct rdma_cm_id **id) {
+    struct suiw_event_channel *ec = (struct suiw_event_channel*) listen->channel;
+    int nonblock = fcntl(ec->ch.fd, F_GETFL) & O_NONBLOCK;
+    pthread_mutex_lock(&ec->lock);
+    for (;;) {
+        for (auto it = ec->events.begin(); it != ec->events.end(); ++it) {
+            if (it->event == RDMA_CM_EVENT_CONNECT_REQUEST && it->listen_id == listen) {
+                *id = it->id;
+                ec->events.erase(it);
+                ec->taken++;
+                pthread_mutex_unlock(&ec->lock);
+                return 0;
+            }
+        }
+        if (nonblock) {
+            pthread_mutex_unlock(&ec->lock);
+            errno = EAGAIN;
+            return -1;
+        }
+        pthread_cond_wait(&ec->cond, &ec->lock);
+    }
+}
+
+//! Sends the MPA reply of a pending request, accepting or rejecting it
+static int suiw_cm_reply(struct rdma_cm_id *id, const void *pdata, uint8_t pd_len, int reject,
+                         uint8_t responder_resources) {
+    struct suiw_cm_id *cm = to_suiw_cm_id(id);
+    pthread_mutex_lock(&cm->lock);
+    if (cm->state != SUIW_CM_REQ || (!reject && id->qp == nullptr)) {
+        pthread_mutex_unlock(&cm->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    cm->rejecting = reject;
+    cm->responder_resources = responder_resources;
+    mpa_handshake_reply(&cm->hs, pdata, pd_len, reject);
+    //! Usually the whole reply fits in the socket buffer right away
+    suiw_cm_progress(cm);
+    pthread_mutex_unlock(&cm->lock);
+    return 0;
+}
+
+int suiw_accept(struct rdma_cm_id *id, struct rdma_conn_param *conn_param) {
+    return suiw_cm_reply(id, conn_param ? conn_param->private_data : NULL,
+                         conn_param ? conn_param->private_data_len : 0, 0,
+                         conn_param ? conn_param->responder_resources : 0);
+}
+
+int suiw_reject(struct rdma_cm_id *id, const void *private_data, uint8_t private_data_len) {
+    return suiw_cm_reply(id, private_data, private_data_len, 1, 0);
+}
+
+int suiw_disconnect(struct rdma_cm_id *id) {
+    struct suiw_cm_id *cm = to_suiw_cm_id(id);
+    pthread_mutex_lock(&cm->lock);
+    if (cm->state != SUIW_CM_ESTABLISHED) {
+        pthread_mutex_unlock(&cm->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    suiw_qp_disconnect((struct suiw_qp*) id->qp);
+    close(cm->fd);
+    cm->fd = -1;
+    cm->state = SUIW_CM_CLOSED;
+    pthread_mutex_unlock(&cm->lock);
+    return suiw_cm_event(cm, RDMA_CM_EVENT_DISCONNECTED, 0, NULL, 0);
 }
 
 int suiw_get_cm_event(struct rdma_event_channel *channel,
             struct rdma_cm_event **event) {
+    struct suiw_event_channel *ec = (struct suiw_event_channel*) channel;
+    // One eventfd count per queued event; blocks unless the user made
+    // the channel fd non-blocking.
+    uint64_t count;
+    for (;;) {
+        if (read(ec->ch.fd, &count, sizeof(count)) != sizeof(count))
+            return -1;
+        pthread_mutex_lock(&ec->lock);
+        if (ec->taken == 0)
+            break;
+        // The count belongs to an event rdma_get_request already took.
+        ec->taken--;
+        pthread_mutex_unlock(&ec->lock);
+    }
     rdma_cm_event *recv_event = (rdma_cm_event*) malloc(sizeof(rdma_cm_event));
+    // The event is queued before the count is bumped.
+    *recv_event = ec->events.front();
+    ec->events.pop_front();
+    pthread_mutex_unlock(&ec->lock);
     *event = recv_event;
-    int ret = recv(channel->fd, recv_event, sizeof(rdma_cm_event), 0);
-    return ret == sizeof(rdma_cm_event) ? 0 : -1;
+    return 0;
 }
 
 int suiw_ack_cm_event(struct rdma_cm_event *event) {
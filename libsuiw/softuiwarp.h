@@ -18,6 +18,20 @@ __be64 suiw_get_device_guid(ibv_device *device);
 
 int suiw_query_device(struct ibv_context *context, struct ibv_device_attr *device_attr);
 
+ibv_pd *suiw_alloc_pd(ibv_context *context);
+
+int suiw_dealloc_pd(ibv_pd *pd);
+
+ibv_cq *suiw_create_cq(ibv_context *context, int cqe, void *cq_context);
+
+int suiw_destroy_cq(ibv_cq *cq);
+
+ibv_qp *suiw_create_qp(ibv_pd *pd, ibv_qp_init_attr *qp_init_attr);
+
+int suiw_destroy_qp(ibv_qp *qp);
+
+ibv_qp_ex *suiw_qp_to_qp_ex(ibv_qp *qp);
+
 rdma_event_channel *suiw_create_event_channel();
 
 void suiw_destroy_event_channel(struct rdma_event_channel*);
@@ -38,4 +52,23 @@ int suiw_ack_cm_event(struct rdma_cm_event *event);
 
 int suiw_resolve_route(struct rdma_cm_id *id, int timeout_ms);
 
+int suiw_bind_addr(struct rdma_cm_id *id, struct sockaddr *addr);
+
+int suiw_cm_create_qp(struct rdma_cm_id *id, struct ibv_pd *pd,
+                      struct ibv_qp_init_attr *qp_init_attr);
+
+void suiw_cm_destroy_qp(struct rdma_cm_id *id);
+
+int suiw_connect(struct rdma_cm_id *id, struct rdma_conn_param *conn_param);
+
+int suiw_listen(struct rdma_cm_id *id, int backlog);
+
+int suiw_get_request(struct rdma_cm_id *listen, struct rdma_cm_id **id);
+
+int suiw_accept(struct rdma_cm_id *id, struct rdma_conn_param *conn_param);
+
+int suiw_reject(struct rdma_cm_id *id, const void *private_data, uint8_t private_data_len);
+
+int suiw_disconnect(struct rdma_cm_id *id);
+
 #endif // SOFTUIWARP_H
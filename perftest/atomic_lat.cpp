@@ -0,0 +1,120 @@
+/*
+ * Software Userspace iWARP device driver for Linux 
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2021 Saksham Goel, Matthew Pabst
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "perftest.h"
+#include "rdmap/rdmap.h"
+
+#include <string.h>
+
+struct atomic_lat_state {
+    struct sge atomic_sg;
+    struct send_wr atomic_wr;
+    uint64_t atomic_expected;
+};
+
+//! --verify: the fetched value must be the count of atomics before this one
+static int atomic_lat_check(perftest_context *perftest_ctx, uint64_t seq) {
+    struct atomic_lat_state *st = (struct atomic_lat_state*) perftest_ctx->priv;
+    uint64_t orig;
+    memcpy(&orig, perftest_ctx->buf, sizeof(orig));
+    if (orig != st->atomic_expected - 1) {
+        lwlog_err("Fetched %lu, expected %lu!", orig, st->atomic_expected - 1);
+        return -1;
+    }
+    return 0;
+}
+
+int atomic_lat_init(perftest_context *perftest_ctx, uint32_t lstag, struct send_data *sd) {
+    if (perftest_ctx->buf_size < (int) sizeof(uint64_t)) {
+        if (!perftest_ctx->sweep) {
+            lwlog_err("Buffer must hold at least one 64-bit word!");
+        }
+        return PERFTEST_SKIP;
+    }
+    struct atomic_lat_state *st = (struct atomic_lat_state*) calloc(1, sizeof(*st));
+    if (!st) {
+        return -1;
+    }
+    perftest_ctx->priv = st;
+    // Build fetch-and-add WR, the original value lands in our buffer.
+    st->atomic_sg.addr = (uint64_t) perftest_ctx->buf;
+    st->atomic_sg.length = sizeof(uint64_t);
+    st->atomic_sg.lkey = lstag;
+    st->atomic_wr.wr_id = 3;
+    st->atomic_wr.sg_list = &st->atomic_sg;
+    st->atomic_wr.num_sge = 1;
+    st->atomic_wr.opcode = RDMAP_ATOMIC_FETCH_ADD;
+    st->atomic_wr.wr.atomic.rkey = sd->stag;
+    st->atomic_wr.wr.atomic.remote_addr = sd->offset;
+    st->atomic_wr.wr.atomic.compare_add = 1;
+    // The client's counter starts at zero.
+    memset(perftest_ctx->buf, 0, sizeof(uint64_t));
+    st->atomic_expected = 0;
+    // Only the server's atomics are timed, the client just serves them.
+    perftest_ctx->records_ops = true;
+    if (!perftest_ctx->is_client) {
+        perftest_ctx->check = atomic_lat_check;
+    }
+    return 0;
+}
+
+int atomic_lat_iter(perftest_context *perftest_ctx) {
+    struct atomic_lat_state *st = (struct atomic_lat_state*) perftest_ctx->priv;
+    // Client does nothing.
+    if (perftest_ctx->is_client) {
+        return 0;
+    }
+    // Server increments the client's counter.
+    int ret;
+    uint64_t start_ns = get_nanos();
+    ret = rdmap_send(perftest_ctx->ctx, st->atomic_wr);
+    if (ret < 0) {
+        lwlog_err("Failed to issue atomic Fetch-and-Add!");
+        return -1;
+    }
+    struct work_completion wc;
+    auto atomic_cq = perftest_ctx->ctx->send_q->cq->q;
+    do { ret = atomic_cq->try_dequeue(wc); } while (!ret) ;
+    perftest_record_op(perftest_ctx, start_ns);
+    lwlog_debug("received completion");
+    if (wc.status != WC_SUCCESS) {
+        lwlog_err("Received atomic completion with error");
+        return -1;
+    } else if (wc.opcode != WC_FETCH_ADD) {
+        lwlog_err("Received wrong message type!");
+        return -1;
+    }
+    st->atomic_expected++;
+    return 0;
+}
+
+void atomic_lat_fini(perftest_context *perftest_ctx, float time_s) {
+    free(perftest_ctx->priv);
+}
+
+int main(int argc, char **argv) {
+    perftest_run(argc, argv, atomic_lat_init, atomic_lat_iter, atomic_lat_fini);
+}
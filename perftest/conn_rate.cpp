@@ -0,0 +1,214 @@
+/*
+ * Software Userspace iWARP device driver for Linux 
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2021 Saksham Goel, Matthew Pabst
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Connection setup rate: the client keeps up to -r TCP connects plus MPA
+ * handshakes in flight on a single thread until -i connections have been
+ * established, the server drives its side of all of them from one epoll
+ * loop as well.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <netdb.h>
+#include <fcntl.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "perftest.h"
+#include "mpa/mpa.h"
+
+struct conn {
+    int connecting;
+    struct mpa_handshake hs;
+};
+
+//! Starts one connection, registered with `epfd`. Returns < 0 if error
+static int conn_start(int epfd, struct addrinfo *res) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (connect(fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    struct conn *c = (struct conn*) malloc(sizeof(struct conn));
+    c->connecting = 1;
+    mpa_handshake_init(&c->hs, fd, 1, NULL, 0);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+//! Drops a finished connection, returns the handshake result
+static int conn_finish(struct conn *c, int ret) {
+    close(c->hs.sockfd);
+    free(c);
+    return ret;
+}
+
+/*
+ * Advances one connection.
+ *  returns: 1 once established, 0 if still in progress, < 0 if error
+ */
+static int conn_progress(struct conn *c) {
+    if (c->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->hs.sockfd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err)
+            return conn_finish(c, -err);
+        c->connecting = 0;
+    }
+    int ret = mpa_handshake_progress(&c->hs);
+    if (ret == MPA_HS_REQ_RCVD) {
+        mpa_handshake_reply(&c->hs, NULL, 0, 0);
+        ret = mpa_handshake_progress(&c->hs);
+    }
+    if (ret < 0 || ret == MPA_HS_REJECTED)
+        return conn_finish(c, ret < 0 ? ret : -ECONNREFUSED);
+    return ret == MPA_HS_DONE ? conn_finish(c, 1) : 0;
+}
+
+static void accept_all(int epfd, int listenfd) {
+    for (;;) {
+        int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0)
+            return;
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        struct conn *c = (struct conn*) malloc(sizeof(struct conn));
+        c->connecting = 0;
+        mpa_handshake_init(&c->hs, fd, 0, NULL, 0);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct perftest_context perftest_ctx;
+    if (perftest_argparse(argc, argv, &perftest_ctx)) {
+        lwlog_err("Failed to parse arguments!");
+        lwlog_notice("Run with -h to see command-line usage.");
+        return 1;
+    }
+
+    struct addrinfo hints;
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res;
+    if (getaddrinfo(perftest_ctx.ip, perftest_ctx.port, &hints, &res)) {
+        perror("getaddrinfo");
+        return 1;
+    }
+
+    int epfd = epoll_create1(0);
+    int listenfd = -1;
+    int started = 0;
+    int in_flight = 0;
+    if (perftest_ctx.is_client) {
+        lwlog_notice("Connecting to server at %s:%s ...", perftest_ctx.ip, perftest_ctx.port);
+    } else {
+        listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int flag = 1;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+        if (bind(listenfd, res->ai_addr, res->ai_addrlen) || listen(listenfd, SOMAXCONN)) {
+            perror("bind/listen");
+            return 1;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = NULL;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+        lwlog_notice("Waiting for %d connections on port %s ... ", perftest_ctx.iters, perftest_ctx.port);
+    }
+
+    uint64_t start_ns = 0;
+    int done = 0;
+    int failed = 0;
+    struct epoll_event events[256];
+    while (done + failed < perftest_ctx.iters) {
+        //! Top the client's window back up
+        while (perftest_ctx.is_client && in_flight < perftest_ctx.max_reqs && started < perftest_ctx.iters) {
+            if (started == 0)
+                start_ns = get_nanos();
+            started++;
+            if (conn_start(epfd, res) < 0) {
+                failed++;
+                continue;
+            }
+            in_flight++;
+        }
+
+        int n = epoll_wait(epfd, events, 256, -1);
+        for (int i = 0; i < n; i++) {
+            struct conn *c = (struct conn*) events[i].data.ptr;
+            if (c == NULL) {
+                if (start_ns == 0)
+                    start_ns = get_nanos();
+                accept_all(epfd, listenfd);
+                continue;
+            }
+            int ret = conn_progress(c);
+            if (ret == 0)
+                continue;
+            in_flight--;
+            if (ret > 0) {
+                done++;
+            } else {
+                lwlog_err("Handshake failed: %s", strerror(-ret));
+                failed++;
+            }
+        }
+    }
+    uint64_t total_ns = get_nanos() - start_ns;
+
+    lwlog_notice("Completed test!");
+    lwlog_notice("Connections established: %d, failed: %d", done, failed);
+    lwlog_notice("Total Time (s): %f", total_ns / (1000.0 * 1000.0 * 1000.0));
+    lwlog_notice("Connection rate (conn/s): %f", done / (total_ns / (1000.0 * 1000.0 * 1000.0)));
+
+    freeaddrinfo(res);
+    if (listenfd >= 0)
+        close(listenfd);
+    close(epfd);
+    return failed != 0;
+}
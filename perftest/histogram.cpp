@@ -0,0 +1,86 @@
+/*
+ * Software Userspace iWARP device driver for Linux 
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2021 Saksham Goel, Matthew Pabst
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "lwlog.h"
+#include "histogram.h"
+
+//! Highest value that still maps to bucket `idx`
+static uint64_t bucket_high(unsigned idx) {
+    unsigned octave = idx / PERFTEST_HIST_SUB;
+    uint64_t sub = idx % PERFTEST_HIST_SUB;
+    if (octave == 0) {
+        return sub;
+    }
+    uint64_t low = (PERFTEST_HIST_SUB | sub) << (octave - 1);
+    return low + (1ULL << (octave - 1)) - 1;
+}
+
+void perftest_hist_init(struct perftest_hist *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void perftest_hist_merge(struct perftest_hist *into, const struct perftest_hist *from) {
+    for (int i = 0; i < PERFTEST_HIST_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->min < into->min) into->min = from->min;
+    if (from->max > into->max) into->max = from->max;
+}
+
+uint64_t perftest_hist_percentile(const struct perftest_hist *h, double percentile) {
+    if (h->count == 0) {
+        return 0;
+    }
+    // Rank of the sample we are after, 1-based.
+    uint64_t rank = (uint64_t) (percentile / 100.0 * h->count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > h->count) rank = h->count;
+    uint64_t seen = 0;
+    for (int i = 0; i < PERFTEST_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t high = bucket_high(i);
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+void perftest_hist_print(const struct perftest_hist *h, const char *what) {
+    if (h->count == 0) {
+        lwlog_notice("%s: no samples on this side", what);
+        return;
+    }
+    lwlog_notice("%s (us): samples %lu min %.3f mean %.3f p50 %.3f p99 %.3f p99.9 %.3f max %.3f",
+                 what, h->count, h->min / 1000.0, (double) h->sum / h->count / 1000.0,
+                 perftest_hist_percentile(h, 50) / 1000.0, perftest_hist_percentile(h, 99) / 1000.0,
+                 perftest_hist_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+}
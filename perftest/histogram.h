@@ -0,0 +1,84 @@
+/*
+ * Software Userspace iWARP device driver for Linux 
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2021 Saksham Goel, Matthew Pabst
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PERFTEST_HISTOGRAM_H
+#define PERFTEST_HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram: every power of
+ * two is split into 2^PERFTEST_HIST_SUB_BITS equal buckets, so any value is
+ * kept to within 1/64 (~1.6%) of itself, from 1 ns up to 2^64 ns, in a fixed
+ * 30 KiB table. Recording is a couple of shifts and an increment, cheap
+ * enough to sit right next to the operation being timed.
+ */
+
+#define PERFTEST_HIST_SUB_BITS 6
+#define PERFTEST_HIST_SUB (1 << PERFTEST_HIST_SUB_BITS)
+#define PERFTEST_HIST_BUCKETS ((64 - PERFTEST_HIST_SUB_BITS + 1) * PERFTEST_HIST_SUB)
+
+struct perftest_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[PERFTEST_HIST_BUCKETS];
+};
+
+static inline unsigned perftest_hist_index(uint64_t value) {
+    if (value < PERFTEST_HIST_SUB) {
+        return value;
+    }
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned octave = msb - PERFTEST_HIST_SUB_BITS + 1;
+    unsigned sub = (value >> (msb - PERFTEST_HIST_SUB_BITS)) & (PERFTEST_HIST_SUB - 1);
+    return octave * PERFTEST_HIST_SUB + sub;
+}
+
+static inline void perftest_hist_record(struct perftest_hist *h, uint64_t value) {
+    h->buckets[perftest_hist_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+}
+
+void perftest_hist_init(struct perftest_hist *h);
+
+//! Adds all of `from`'s samples to `into`
+void perftest_hist_merge(struct perftest_hist *into, const struct perftest_hist *from);
+
+/*
+ * Value at or below which `percentile` percent of the samples fall,
+ * reported as the highest value of its bucket.
+ */
+uint64_t perftest_hist_percentile(const struct perftest_hist *h, double percentile);
+
+//! Logs count, min, mean, p50, p99, p99.9 and max in microseconds
+void perftest_hist_print(const struct perftest_hist *h, const char *what);
+
+#endif // PERFTEST_HISTOGRAM_H
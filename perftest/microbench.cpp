@@ -0,0 +1,383 @@
+/*
+ * Software Userspace iWARP device driver for Linux 
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2021 Saksham Goel, Matthew Pabst
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Component microbenchmarks: MPA framing, DDP parsing and lookups, CQ and RQ
+ * operations and byte-order conversions, each timed on its own. Nothing
+ * touches a socket. sendmsg() and recv() on the transport's descriptor are
+ * intercepted here, the way TAS intercepts them (see USE_TAS), and served
+ * from memory. A change in one layer shows up in that layer's line.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <dlfcn.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "cq.h"
+#include "mpa/mpa.h"
+#include "ddp/ddp.h"
+#include "rdmap/rdmap.h"
+#include "perftest.h"
+
+#define DEFAULT_BENCH_OPS (1 << 20)
+#define BENCH_BATCH 256
+
+/*
+ * In-memory transport. In sink mode sends are counted and dropped. In
+ * record mode they are appended to `buf`, and recv() replays `buf` from the
+ * start whenever it runs out.
+ */
+struct mem_transport {
+    int fd = -1;
+    bool record = false;
+    char *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    size_t off = 0;
+    uint64_t bytes = 0;
+};
+
+static struct mem_transport mem;
+
+extern "C" ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    static ssize_t (*real_sendmsg)(int, const struct msghdr*, int) =
+        (ssize_t (*)(int, const struct msghdr*, int)) dlsym(RTLD_NEXT, "sendmsg");
+    if (fd != mem.fd) {
+        return real_sendmsg(fd, msg, flags);
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; i++) {
+        size_t n = msg->msg_iov[i].iov_len;
+        if (mem.record) {
+            if (mem.len + n > mem.cap) {
+                mem.cap = 2 * (mem.len + n);
+                mem.buf = (char*) realloc(mem.buf, mem.cap);
+            }
+            memcpy(mem.buf + mem.len, msg->msg_iov[i].iov_base, n);
+            mem.len += n;
+        }
+        total += n;
+    }
+    mem.bytes += total;
+    return total;
+}
+
+extern "C" ssize_t recv(int fd, void *buf, size_t len, int flags) {
+    static ssize_t (*real_recv)(int, void*, size_t, int) =
+        (ssize_t (*)(int, void*, size_t, int)) dlsym(RTLD_NEXT, "recv");
+    if (fd != mem.fd) {
+        return real_recv(fd, buf, len, flags);
+    }
+    if (mem.off == mem.len) {
+        mem.off = 0;
+    }
+    size_t n = len < mem.len - mem.off ? len : mem.len - mem.off;
+    memcpy(buf, mem.buf + mem.off, n);
+    mem.off += n;
+    return n;
+}
+
+static void mem_reset(bool record) {
+    mem.record = record;
+    mem.len = 0;
+    mem.off = 0;
+    mem.bytes = 0;
+}
+
+//! Keeps the compiler from dropping work whose result is unused
+static volatile uint64_t bench_sink;
+
+static void report(const char *name, uint64_t ops, uint64_t ns) {
+    printf("%-40s %10.1f ns/op %10.2f Mops/s\n", name, (double) ns / ops, ops * 1000.0 / ns);
+}
+
+static void bench_byte_order(uint64_t ops) {
+    uint32_t w32[BENCH_BATCH];
+    uint64_t w64[BENCH_BATCH];
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        w32[i] = i * 2654435761u;
+        w64[i] = i * 0x9e3779b97f4a7c15ull;
+    }
+    uint64_t acc = 0;
+    uint64_t start = get_nanos();
+    for (uint64_t n = 0; n < ops; n += BENCH_BATCH) {
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            w32[i] = ntohl(w32[i]);
+        }
+        acc += w32[n % BENCH_BATCH];
+    }
+    report("byte order: ntohl", ops, get_nanos() - start);
+    start = get_nanos();
+    for (uint64_t n = 0; n < ops; n += BENCH_BATCH) {
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            w64[i] = ntohll(w64[i]);
+        }
+        acc += w64[n % BENCH_BATCH];
+    }
+    report("byte order: ntohll", ops, get_nanos() - start);
+    bench_sink = acc;
+}
+
+static void bench_cq(uint64_t ops) {
+    struct cq *cq = create_cq(NULL, BENCH_BATCH);
+    struct work_completion wce{}, wcs[BENCH_BATCH];
+    wce.opcode = WC_SEND;
+    uint64_t push_ns = 0, poll_ns = 0;
+    for (uint64_t n = 0; n < ops; n += BENCH_BATCH) {
+        uint64_t start = get_nanos();
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            wce.wr_id = n + i;
+            cq_push(cq, wce);
+        }
+        uint64_t mid = get_nanos();
+        int got = 0;
+        while (got < BENCH_BATCH) {
+            got += poll_cq(cq, BENCH_BATCH - got, wcs + got);
+        }
+        poll_ns += get_nanos() - mid;
+        push_ns += mid - start;
+    }
+    report("cq: cq_push (enqueue)", ops, push_ns);
+    report("cq: poll_cq (batches of 256)", ops, poll_ns);
+    destroy_cq(cq);
+}
+
+static void bench_post_recv(struct ddp_stream_context *ddp_ctx, struct pd_t *pd, uint64_t ops) {
+    // rdma_post_recv only needs the DDP context and the RQ, no threads.
+    struct rdmap_stream_context *ctx = new rdmap_stream_context();
+    struct wq_init_attr wq_attr{};
+    wq_attr.wq_type = wq_type::WQT_RQ;
+    wq_attr.max_wr = BENCH_BATCH;
+    wq_attr.pd = pd;
+    ctx->ddp_ctx = ddp_ctx;
+    ctx->recv_q = create_wq(ctx, &wq_attr);
+
+    char data[64];
+    struct sge sg = {(uint64_t) data, sizeof(data), 0};
+    struct recv_wr wr{};
+    wr.sg_list = &sg;
+    wr.num_sge = 1;
+    uint64_t ns = 0;
+    for (uint64_t n = 0; n < ops; n += BENCH_BATCH) {
+        uint64_t start = get_nanos();
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            wr.wr_id = n + i;
+            rdma_post_recv(ctx, wr);
+        }
+        ns += get_nanos() - start;
+        // Drain both queues untimed, as ddp_recv and rnic_recv would.
+        struct untagged_buffer ub;
+        struct recv_wr out;
+        while (ddp_ctx->queues[SEND_QN].q->try_dequeue(ub)) ;
+        while (ctx->recv_q->recv_q->try_dequeue(out)) ;
+    }
+    report("rq: rdma_post_recv", ops, ns);
+    destroy_wq(ctx->recv_q);
+    delete ctx;
+}
+
+static void bench_check_stag(struct pd_t *pd, int nbufs, uint64_t ops) {
+    struct ddp_stream_context *ctx = ddp_init_stream(mem.fd, pd);
+    // Each registration needs its own address, the STag is derived from it.
+    char *region = (char*) malloc((size_t) nbufs * 64);
+    struct ddp_tagged_meta *hdrs = new ddp_tagged_meta[nbufs];
+    for (int i = 0; i < nbufs; i++) {
+        struct tagged_buffer tb;
+        memset(&tb, 0, sizeof(tb));
+        tb.data = region + (size_t) i * 64;
+        tb.len = 64;
+        register_tagged_buffer(ctx, &tb);
+        hdrs[i].tag = tb.stag.tag;
+        hdrs[i].TO = (uint64_t) tb.data + 8;
+    }
+    uint64_t acc = 0;
+    uint64_t start = get_nanos();
+    for (uint64_t n = 0; n < ops; n++) {
+        acc += (uint64_t) ddp_check_stag(ctx, &hdrs[n % nbufs]);
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "ddp: ddp_check_stag (%d registered)", nbufs);
+    report(name, ops, get_nanos() - start);
+    bench_sink = acc;
+    delete[] hdrs;
+    free(region);
+    ddp_kill_stream(ctx);
+}
+
+static void bench_mpa_send(int payload, uint64_t ops) {
+    char *data = (char*) calloc(1, payload);
+    struct sge sg = {(uint64_t) data, (uint32_t) payload, 0};
+    mem_reset(false);
+    uint64_t start = get_nanos();
+    for (uint64_t n = 0; n < ops; n++) {
+        mpa_send(mem.fd, &sg, 1, 0);
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "mpa: mpa_send (%d B FPDU)", payload);
+    report(name, ops, get_nanos() - start);
+    free(data);
+}
+
+/*
+ * Tagged messages of `payload` bytes, framed by ddp_send_tagged into the
+ * sink and then parsed back by ddp_recv from a recording.
+ */
+static void bench_ddp_tagged(struct pd_t *pd, int payload, uint64_t ops) {
+    struct ddp_stream_context *ctx = ddp_init_stream(mem.fd, pd);
+    char *src = (char*) calloc(1, payload);
+    char *dst = (char*) calloc(1, payload);
+    struct tagged_buffer tb;
+    memset(&tb, 0, sizeof(tb));
+    tb.data = dst;
+    tb.len = payload;
+    register_tagged_buffer(ctx, &tb);
+    struct ddp_tagged_meta hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.tag = htonl(tb.stag.tag);
+    hdr.TO = htonll((uint64_t) dst);
+    struct sge sg = {(uint64_t) src, (uint32_t) payload, 0};
+    char name[64];
+
+    mem_reset(false);
+    uint64_t start = get_nanos();
+    for (uint64_t n = 0; n < ops; n++) {
+        ddp_send_tagged(ctx, &hdr, &sg, 1);
+    }
+    snprintf(name, sizeof(name), "ddp: ddp_send_tagged (%d B)", payload);
+    report(name, ops, get_nanos() - start);
+
+    // One message is enough, recv() replays it.
+    mem_reset(true);
+    ddp_send_tagged(ctx, &hdr, &sg, 1);
+    struct ddp_message msg;
+    start = get_nanos();
+    for (uint64_t n = 0; n < ops; n++) {
+        if (ddp_recv(ctx, &msg)) {
+            lwlog_err("ddp_recv failed on the recording!");
+            break;
+        }
+    }
+    snprintf(name, sizeof(name), "ddp: ddp_recv tagged (%d B)", payload);
+    report(name, ops, get_nanos() - start);
+    free(src);
+    free(dst);
+    ddp_kill_stream(ctx);
+}
+
+//! Untagged Sends parsed by ddp_recv, each needs a posted buffer (untimed)
+static void bench_ddp_untagged(struct pd_t *pd, int payload, uint64_t ops) {
+    struct ddp_stream_context *ctx = ddp_init_stream(mem.fd, pd);
+    char *src = (char*) calloc(1, payload);
+    char *dst = (char*) calloc(1, payload);
+    struct ddp_untagged_meta hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.qn = htonl(SEND_QN);
+    hdr.msn = htonl(1);
+    struct sge sg = {(uint64_t) src, (uint32_t) payload, 0};
+    mem_reset(true);
+    ddp_send_untagged(ctx, &hdr, &sg, 1);
+
+    struct untagged_buffer bufs[BENCH_BATCH];
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        bufs[i].data = dst;
+        bufs[i].len = payload;
+        bufs[i].next = NULL;
+    }
+    struct ddp_message msg;
+    uint64_t ns = 0;
+    for (uint64_t n = 0; n < ops; n += BENCH_BATCH) {
+        ddp_post_recv(ctx, SEND_QN, bufs, BENCH_BATCH);
+        uint64_t start = get_nanos();
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            ddp_recv(ctx, &msg);
+        }
+        ns += get_nanos() - start;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "ddp: ddp_recv untagged (%d B)", payload);
+    report(name, ops, ns);
+    free(src);
+    free(dst);
+    ddp_kill_stream(ctx);
+}
+
+static void print_help() {
+    printf("Usage: \n\
+    -h : Print this message. \n\
+    -i [OPS] : Operations per benchmark. Default %d. \n", DEFAULT_BENCH_OPS);
+}
+
+int main(int argc, char **argv) {
+    uint64_t ops = DEFAULT_BENCH_OPS;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:h")) != -1) {
+        switch (opt) {
+          case 'i':
+            ops = strtoull(optarg, NULL, 10);
+            break;
+          case 'h':
+            print_help();
+            return 0;
+          default:
+            print_help();
+            return 1;
+        }
+    }
+    // Round up to whole batches.
+    ops = (ops + BENCH_BATCH - 1) / BENCH_BATCH * BENCH_BATCH;
+
+    // Only used as a descriptor number nothing else can own.
+    mem.fd = eventfd(0, EFD_CLOEXEC);
+    if (mem.fd < 0) {
+        perror("eventfd");
+        return 1;
+    }
+    struct pd_t pd = {1};
+    struct ddp_stream_context *ddp_ctx = ddp_init_stream(mem.fd, &pd);
+
+    bench_byte_order(ops);
+    bench_cq(ops);
+    bench_post_recv(ddp_ctx, &pd, ops);
+    bench_check_stag(&pd, 1, ops);
+    bench_check_stag(&pd, 1024, ops);
+    bench_mpa_send(16, ops);
+    bench_mpa_send(1024, ops);
+    bench_ddp_tagged(&pd, 16, ops);
+    bench_ddp_tagged(&pd, 1024, ops);
+    bench_ddp_untagged(&pd, 16, ops);
+    bench_ddp_untagged(&pd, 1024, ops);
+
+    ddp_kill_stream(ddp_ctx);
+    close(mem.fd);
+    free(mem.buf);
+    return 0;
+}
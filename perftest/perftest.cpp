@@ -25,15 +25,22 @@
  */
 
 #include <stdio.h>
+#include <ctype.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <netdb.h>
+#include <getopt.h>
+#include <pthread.h>
 
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <x86intrin.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 
@@ -58,12 +65,65 @@ static void print_help() {
     -i [ITERS] : Set the number of iterations. \n\
                  Defuault 1000. \n\
     -r [MAX_REQS] : Set the max number of in-flight requests, only used for bandwidth tests. \n\
+                    For conn_rate, the number of handshakes kept in flight. \n\
+    -C [CPUS] : Run the progress threads on these CPUs, e.g. 2,3 or 4-7. \n\
+    -N [NODE] : Allocate the stream and the test buffer on this NUMA node. \n\
+    -q [STREAMS] : Open this many RDMAP streams, each with its own buffer. \n\
+                   Default 1. \n\
+    -t [THREADS] : Drive the streams from this many threads. Default 1. \n\
+    -a : Run every power-of-two message size from 1 byte up to -b, on the same connections. \n\
+    -f [csv|json] : Also print the results to stdout in this format. \n\
+    -B : Bidirectional, both sides send at once (write_bw, send_bw). Pass it to both sides. \n\
+    --verify[=N] : Check the data on every Nth iteration (default every one), outside the timed \n\
+                   region. Supported by read_lat, read_bw and atomic_lat. \n\
+    --loopback : Run client and server in this process over socketpairs, -c/-s/-p are ignored. \n\
+    --rate [OPS/S] : Open-loop tests: peak offered load per stream, in operations per second. \n\
+    --load-steps [STEPS] : Open-loop tests: run this many equal load steps up to --rate. \n\
+                           Default 10. \n\
+    --poisson : Open-loop tests: space operations with exponential gaps instead of evenly. \n\
 Example: \n\
     On server-side: ./read_lat -s 10.10.1.1 \n\
     On client-side: ./read_lat -s 10.10.1.1 -c\n");
 }
 
-static int argparse(int argc, char **argv, struct perftest_context *c) {
+//! Long options, past the range of the single-letter ones
+enum {
+    OPT_LOOPBACK = 256,
+    OPT_RATE,
+    OPT_LOAD_STEPS,
+    OPT_POISSON,
+    OPT_VERIFY,
+};
+
+//! Parses "2,3" or "4-7" style lists, 0 on success
+static int parse_cpu_list(const char *list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    while (*list) {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0)
+            return -1;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+                return -1;
+        }
+        if (last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        list = end;
+    }
+    return 0;
+}
+
+int perftest_argparse(int argc, char **argv, struct perftest_context *c) {
     int opt;
     c->buf_size = DEFAULT_BUF_SIZE;
     c->iters = DEFAULT_ITERS;
@@ -71,7 +131,29 @@ static int argparse(int argc, char **argv, struct perftest_context *c) {
     c->port = (char*) DEFAULT_PORT;
     c->is_client = false;
     c->max_reqs = DEFAULT_MAX_REQS;
-    while ((opt = getopt(argc, argv, "p:s:b:i:r:ch")) != -1) {
+    CPU_ZERO(&c->cpus);
+    c->num_cpus = 0;
+    c->numa_node = -1;
+    c->num_streams = 1;
+    c->num_threads = 1;
+    c->sweep = false;
+    c->format = NULL;
+    c->loopback = false;
+    c->rate = 0;
+    c->load_steps = DEFAULT_LOAD_STEPS;
+    c->poisson = false;
+    c->offered_rate = 0;
+    c->bidir = false;
+    c->verify_every = 0;
+    static const struct option long_opts[] = {
+        {"loopback", no_argument, NULL, OPT_LOOPBACK},
+        {"rate", required_argument, NULL, OPT_RATE},
+        {"load-steps", required_argument, NULL, OPT_LOAD_STEPS},
+        {"poisson", no_argument, NULL, OPT_POISSON},
+        {"verify", optional_argument, NULL, OPT_VERIFY},
+        {NULL, 0, NULL, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "p:s:b:i:r:C:N:q:t:f:aBch", long_opts, NULL)) != -1) {
         switch (opt) {
           case 's':
             c->ip = optarg;
@@ -94,6 +176,70 @@ static int argparse(int argc, char **argv, struct perftest_context *c) {
           case 'r':
             c->max_reqs = atoi(optarg);
             break;
+          case 'C':
+            if (parse_cpu_list(optarg, &c->cpus)) {
+                lwlog_err("Bad CPU list '%s'.", optarg);
+                return 1;
+            }
+            c->num_cpus = CPU_COUNT(&c->cpus);
+            break;
+          case 'N':
+            c->numa_node = atoi(optarg);
+            break;
+          case 'a':
+            c->sweep = true;
+            break;
+          case 'B':
+            c->bidir = true;
+            break;
+          case OPT_LOOPBACK:
+            c->loopback = true;
+            break;
+          case OPT_RATE:
+            c->rate = atof(optarg);
+            if (c->rate <= 0) {
+                lwlog_err("The offered rate must be positive.");
+                return 1;
+            }
+            break;
+          case OPT_LOAD_STEPS:
+            c->load_steps = atoi(optarg);
+            if (c->load_steps < 1) {
+                lwlog_err("Need at least one load step.");
+                return 1;
+            }
+            break;
+          case OPT_POISSON:
+            c->poisson = true;
+            break;
+          case OPT_VERIFY:
+            c->verify_every = optarg ? atoi(optarg) : 1;
+            if (c->verify_every < 1) {
+                lwlog_err("--verify needs a positive interval.");
+                return 1;
+            }
+            break;
+          case 'f':
+            if (strcmp(optarg, "csv") && strcmp(optarg, "json")) {
+                lwlog_err("Unknown output format '%s'.", optarg);
+                return 1;
+            }
+            c->format = optarg;
+            break;
+          case 'q':
+            c->num_streams = atoi(optarg);
+            if (c->num_streams < 1) {
+                lwlog_err("Need at least one stream.");
+                return 1;
+            }
+            break;
+          case 't':
+            c->num_threads = atoi(optarg);
+            if (c->num_threads < 1) {
+                lwlog_err("Need at least one thread.");
+                return 1;
+            }
+            break;
           case '?':
             if (optopt == 'c') {
                 lwlog_err("Option -%c requires an argument.", optopt);
@@ -110,12 +256,6 @@ static int argparse(int argc, char **argv, struct perftest_context *c) {
     return 0;
 }
 
-static inline uint64_t get_nanos(void) {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (uint64_t) ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
-}
-
 /**
  * @brief Create a tcp connection object
  * 
@@ -125,6 +265,10 @@ static inline uint64_t get_nanos(void) {
 static int create_tcp_connection(struct perftest_context *config) {
     int ret;
     int sock;
+    if (config->loopback) {
+        // Both sides' sockets were made up front, hand out the next one.
+        return config->loop_fds[config->loop_next++];
+    }
     // Create the socket.
     sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
@@ -181,23 +325,30 @@ fail:
 
 static int alloc_buf(struct perftest_context *c) {
     // Allocate regions.
-    c->buf = (char*) mmap(NULL, c->buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    int populate = c->numa_node < 0 ? MAP_POPULATE : 0;
+    c->buf = (char*) mmap(NULL, c->buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
     if (c->buf == MAP_FAILED) {
         return -1;
     }
+    if (!populate) {
+        // Bind before the first touch, so the pages come from the node.
+        unsigned long nodes[16] = {0};
+        if (c->numa_node >= (int) (8 * sizeof(nodes))) {
+            return -1;
+        }
+        nodes[c->numa_node / (8 * sizeof(unsigned long))] |= 1UL << (c->numa_node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, c->buf, c->buf_size, MPOL_BIND, nodes, 8 * sizeof(nodes) + 1, 0)) {
+            perror("mbind");
+        }
+        memset(c->buf, 0, c->buf_size);
+    }
     return 0;
 }
 
 static int rdmap_send_data(struct perftest_context *perftest_ctx, void *data, size_t data_len, struct send_wr &wr) {
     wr.sg_list->addr = (uint64_t) data;
     wr.sg_list->length = data_len;
-    int ret = rdmap_send(perftest_ctx->ctx, wr);
-    // ACK the associated event.
-    struct work_completion wc;
-    auto cqq = perftest_ctx->ctx->send_q->cq->q;
-    int suc;
-    do { suc = cqq->try_dequeue(wc); } while (!suc) ;
-    return ret;
+    return rdmap_send(perftest_ctx->ctx, wr);
 }
 
 static int rdmap_recv_issue(struct perftest_context *perftest_ctx, void *buf, size_t buf_len, struct recv_wr &wr) {
@@ -207,19 +358,29 @@ static int rdmap_recv_issue(struct perftest_context *perftest_ctx, void *buf, si
     return rdma_post_recv(perftest_ctx->ctx, wr);
 }
 
-static int rdmap_recv_ack(struct perftest_context *perftest_ctx) {
-    // Poll the receive completion queue.
+/*
+ * Waits for our send and the peer's send to complete. Both land on the one
+ * CQ in either order, depending on who sent first.
+ */
+static int rdmap_exchange_ack(struct perftest_context *perftest_ctx) {
     int ret;
+    int sends = 1, recvs = 1;
     struct work_completion wc;
     auto cqq = perftest_ctx->ctx->recv_q->cq->q;
-    do { ret = cqq->try_dequeue(wc); } while (!ret) ;
-    lwlog_debug("Received send data with id %lu", wc.wr_id);
-    if (wc.status != WC_SUCCESS) {
-        lwlog_err("Received remote send with error");
-        return -1;
-    } else if (wc.opcode != WC_SEND) {
-        lwlog_err("Received wrong message type!");
-        return -1;
+    while (sends > 0 || recvs > 0) {
+        do { ret = cqq->try_dequeue(wc); } while (!ret) ;
+        if (wc.status != WC_SUCCESS) {
+            lwlog_err("Received completion with error");
+            return -1;
+        } else if (wc.opcode == WC_SEND) {
+            sends--;
+        } else if (wc.opcode == WC_RECV) {
+            lwlog_debug("Received send data with id %lu", wc.wr_id);
+            recvs--;
+        } else {
+            lwlog_err("Received wrong message type!");
+            return -1;
+        }
     }
     return 0;
 }
@@ -230,42 +391,98 @@ static void sync_with_remote(struct perftest_context *perftest_ctx, int sync_soc
     recv(sync_sock, &dummy, sizeof(dummy), 0);
 }
 
-void perftest_run(int argc, char **argv, 
-                  int (*test_init)(perftest_context*, uint32_t, struct send_data*),
-                  int (*test_iter)(perftest_context*),
-                  void (*test_fini)(perftest_context*, float))
-{
-    //! Parse arguments.
-    struct perftest_context perftest_ctx;
-    perftest_ctx.serverfd = -1;
-    if (argparse(argc, argv, &perftest_ctx)) {
-        lwlog_err("Failed to parse arguments!");
-        lwlog_notice("Run with -h to see command-line usage.");
-        return;
-    }
+/*
+ * Everything one RDMAP stream needs: its own buffer, queues, connection and
+ * sync socket, so streams never contend on anything but the CPUs.
+ */
+struct perftest_stream {
+    struct perftest_context c;
+    int sockfd;
+    int sync_sock;
+    struct sge send_sg;
+    struct send_wr send_wr;
+    struct sge recv_sg;
+    struct recv_wr recv_wr;
+    //! Our buffer's STag and the peer's buffer, handed to test_init
+    uint32_t stag;
+    struct send_data their_sd;
+    //! Time spent inside test_iter, summed over the iterations
+    uint64_t total_ns;
+    struct perftest_hist lat;
+    //! Iterations run over all sizes so far, the --verify pattern's seq
+    uint64_t seq;
+    //! Iterations whose data was checked at the current size
+    int verified;
+};
+
+struct perftest_worker {
+    pthread_t thread;
+    int id;
+    struct perftest_stream *streams;
+    int num_streams;
+    int num_threads;
+    pthread_barrier_t *start;
+    int (*test_iter)(perftest_context*);
+    int ret;
+    uint64_t cpu_ns;    // CPU time spent in the timed loop
+};
+
+//! One row of the results table, one per message size
+struct perftest_result {
+    int size;
+    double offered_Mpps;    // open-loop tests, 0 otherwise
+    double time_s;
+    double Mpps;
+    double MBps;
+    double tx_MBps;         // bidirectional tests, each way
+    double rx_MBps;
+    double cpu_pct;         // this side's threads, % of one core
+    double cpu_app_pct;     // perftest threads
+    double cpu_send_pct;    // rnic_send threads
+    double cpu_recv_pct;    // rnic_recv threads
+    double cycles_per_msg;
+    double cycles_per_byte;
+    double lat_us[6];   // min, mean, p50, p99, p99.9, max
+};
+
+/*
+ * Connects stream `id` and swaps buffer addresses with the remote.
+ *  returns: 0 on success, -1 on failure.
+ */
+static int stream_open(struct perftest_context *base, struct perftest_stream *s, int id) {
+    s->c = *base;
+    s->c.buf = NULL;
+    s->c.buf_max = base->buf_size;
+    s->c.stream_id = id;
+    s->c.priv = NULL;
+    s->c.recvs_posted = 0;
+    s->c.lat = &s->lat;
+    s->sockfd = -1;
+    s->sync_sock = -1;
+    s->c.ctx = NULL;
 
     // Alloc hugepage buffer.
-    if (alloc_buf(&perftest_ctx) != 0) {
+    if (alloc_buf(&s->c) != 0) {
         lwlog_err("Failed to allocate hugepage buffer!");
-        return;
+        return -1;
     }
 
-    // Timing information.
-    uint64_t start_ns, end_ns, total_ns;
-    total_ns = 0;
+    //! Protection Domain, shared by every stream on both sides
+    static struct pd_t pd = {1};
 
-    //! Protection Domain
-    struct pd_t pd;
-    pd.pd_id = 1;
+    //! The CQ and SQ/RQ are allocated before the stream, so they need the
+    //! -N placement of their own
+    struct rdmap_mempolicy saved_policy;
+    int placed = s->c.numa_node >= 0 && rdmap_prefer_node(s->c.numa_node, &saved_policy) == 0;
 
     //! Create CQ
-    struct cq* cq = create_cq(NULL, perftest_ctx.max_reqs+2);
+    struct cq* cq = create_cq(NULL, s->c.max_reqs+2);
 
     //! Create SQ/RQ
     struct wq_init_attr wq_attr;
     wq_attr.wq_type = wq_type::WQT_SQ;
-    wq_attr.max_wr = perftest_ctx.max_reqs + 2;
-    wq_attr.max_sge = perftest_ctx.max_reqs + 2;
+    wq_attr.max_wr = s->c.max_reqs + 2;
+    wq_attr.max_sge = s->c.max_reqs + 2;
     wq_attr.pd = &pd;
     wq_attr.cq = cq;
 
@@ -273,38 +490,49 @@ void perftest_run(int argc, char **argv,
 
     wq_attr.wq_type = wq_type::WQT_RQ;
     struct wq* rq = create_wq(NULL, &wq_attr);
+    if (placed)
+        rdmap_restore_policy(&saved_policy);
 
     //! RDMAP Init Attributes
     struct rdmap_stream_init_attr attr;
     attr.send_q = sq;
     attr.recv_q = rq;
 
-    //! TCP Connection
-    int sockfd = create_tcp_connection(&perftest_ctx);
-    if (sockfd < 0) {
+    //! TCP Connection, the listening socket stays with `base`
+    s->sockfd = create_tcp_connection(base);
+    if (s->sockfd < 0) {
         lwlog_err("cannot create socket");
-        return;
+        return -1;
     }
     int flag = 1;
-    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
-    attr.sockfd = sockfd;
-    attr.max_pending_read_requests = perftest_ctx.max_reqs + 2;
+    setsockopt(s->sockfd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+    attr.sockfd = s->sockfd;
+    attr.max_pending_read_requests = s->c.max_reqs + 2;
+    attr.cpus = s->c.num_cpus ? &s->c.cpus : NULL;
+    attr.numa_node = s->c.numa_node;
 
-    int sync_sock = create_tcp_connection(&perftest_ctx);
-    if (sync_sock < 0) {
+    s->sync_sock = create_tcp_connection(base);
+    if (s->sync_sock < 0) {
         lwlog_err("cannot create synchronization socket!");
-        return;
+        return -1;
     }
+    s->c.serverfd = base->serverfd;
 
     // MPA connection.
-    if (perftest_ctx.is_client) {
-        mpa_client_connect(sockfd, NULL, 0, NULL);
+    int mpa_ret;
+    if (s->c.is_client) {
+        mpa_ret = mpa_client_connect(s->sockfd, NULL, 0, NULL);
     } else {
-        mpa_server_accept(sockfd, NULL, 0, NULL);
+        mpa_ret = mpa_server_accept(s->sockfd, NULL, 0, NULL);
     }
+    attr.suiw_ext = mpa_ret > 0;
 
     //! Register Buffers
     struct rdmap_stream_context* ctx = rdmap_init_stream(&attr);
+    if (ctx == NULL) {
+        lwlog_err("Couldn't start the RDMAP stream");
+        return -1;
+    }
 
     //! Register context with CQ/SQ/RQ
     cq->ctx = ctx;
@@ -313,118 +541,625 @@ void perftest_run(int argc, char **argv,
 
     // Create Tagged Buffer for read
     tagged_buffer tg_buf;
-    tg_buf.data = (char*)perftest_ctx.buf;
-    tg_buf.len = perftest_ctx.buf_size;
+    tg_buf.data = (char*)s->c.buf;
+    tg_buf.len = s->c.buf_max;
 
     register_tagged_buffer(ctx->ddp_ctx, &tg_buf);
-    __u32 stag = tg_buf.stag.tag;
+    s->stag = tg_buf.stag.tag;
 
     // Build send WR.
-    struct sge send_sg;
-    struct send_wr send_wr;
-    send_wr.wr_id = 1;
-    send_wr.sg_list = &send_sg;
-    send_wr.num_sge = 1;
-    send_wr.opcode = RDMAP_SEND;
+    s->send_wr.wr_id = 1;
+    s->send_wr.sg_list = &s->send_sg;
+    s->send_wr.num_sge = 1;
+    s->send_wr.opcode = RDMAP_SEND;
+    // Control messages are small, copy them at post time.
+    s->send_wr.send_flags = SEND_INLINE;
 
     // Build recv WR.
-    struct sge recv_sg;
-    struct recv_wr recv_wr;
-    recv_wr.wr_id = 1901;
-    recv_wr.sg_list = &recv_sg;
-    recv_wr.num_sge = 1;
+    s->recv_wr.wr_id = 1901;
+    s->recv_wr.sg_list = &s->recv_sg;
+    s->recv_wr.num_sge = 1;
 
-    perftest_ctx.ctx = ctx;
+    s->c.ctx = ctx;
 
-    int ret;
     struct send_data my_sd;
-    my_sd.offset = (uint64_t) perftest_ctx.buf;
-    my_sd.stag = stag;
-    my_sd.size = perftest_ctx.buf_size;
-    struct send_data their_sd;
-    if (perftest_ctx.is_client) {
-        // Receive remote_addr and rkey from server.
-        if (rdmap_recv_issue(&perftest_ctx, (void*) &their_sd, sizeof(struct send_data), recv_wr) < 0) {
-            lwlog_err("failed to issue recv for server info!");
-        }
-        sync_with_remote(&perftest_ctx, sync_sock);
-        // Send remote_addr and rkey to server.
-        if (rdmap_send_data(&perftest_ctx, (void*) &my_sd, sizeof(struct send_data), send_wr) < 0) {
-            lwlog_err("failed to send client info!");
-        }
-        // Complete recv.
-        if (rdmap_recv_ack(&perftest_ctx)) {
-            lwlog_err("failed to recv server info!");
+    my_sd.offset = (uint64_t) s->c.buf;
+    my_sd.stag = s->stag;
+    my_sd.size = s->c.buf_max;
+    struct send_data &their_sd = s->their_sd;
+    const char *peer = s->c.is_client ? "server" : "client";
+    // Receive remote_addr and rkey from the peer.
+    if (rdmap_recv_issue(&s->c, (void*) &their_sd, sizeof(struct send_data), s->recv_wr) < 0) {
+        lwlog_err("failed to issue recv for %s info!", peer);
+    }
+    sync_with_remote(&s->c, s->sync_sock);
+    // Send remote_addr and rkey to the peer.
+    if (rdmap_send_data(&s->c, (void*) &my_sd, sizeof(struct send_data), s->send_wr) < 0) {
+        lwlog_err("failed to send our info to the %s!", peer);
+    }
+    // Complete both.
+    if (rdmap_exchange_ack(&s->c)) {
+        lwlog_err("failed to recv %s info!", peer);
+    }
+    lwlog_debug("Received addr %p stag %lu and size %lu from %s.", (void*)their_sd.offset, their_sd.stag, their_sd.size, peer);
+    return 0;
+}
+
+/*
+ * Sets the stream up for one message size and hands it to the test.
+ *  returns: test_init's result, PERFTEST_SKIP if it cannot run this size.
+ */
+static int stream_prepare(struct perftest_stream *s, int size,
+                          int (*test_init)(perftest_context*, uint32_t, struct send_data*)) {
+    s->c.buf_size = size;
+    s->c.priv = NULL;
+    s->c.msgs_per_iter = 0;
+    s->c.records_ops = false;
+    s->c.tx_ns = 0;
+    s->c.rx_ns = 0;
+    s->c.stamp = NULL;
+    s->c.check = NULL;
+    s->total_ns = 0;
+    s->verified = 0;
+    perftest_hist_init(&s->lat);
+    return test_init(&s->c, s->stag, &s->their_sd);
+}
+
+/*
+ * Tells the client how long the server's side of the stream took. This goes
+ * over the sync socket: tests may leave receives posted on the stream.
+ */
+static void stream_swap_time(struct perftest_stream *s) {
+    if (s->c.is_client) {
+        lwlog_info("Waiting for server finished notification ...");
+        if (recv(s->sync_sock, &s->total_ns, sizeof(uint64_t), MSG_WAITALL) != sizeof(uint64_t)) {
+            lwlog_err("failed to recv server completion!");
         }
-        lwlog_debug("Received addr %p stag %lu and size %lu from server.", (void*)their_sd.offset, their_sd.stag, their_sd.size);
     } else {
-        // Receive remote_addr and rkey from client.
-        if (rdmap_recv_issue(&perftest_ctx, (void*) &their_sd, sizeof(struct send_data), recv_wr) < 0) {
-            lwlog_err("failed to issue recv for client info!");
-        }
-        sync_with_remote(&perftest_ctx, sync_sock);
-        // Send remote_addr and rkey to server.
-        if (rdmap_send_data(&perftest_ctx, (void*) &my_sd, sizeof(struct send_data), send_wr) < 0) {
-            lwlog_err("failed to send server info!");
+        lwlog_info("Finished benchmarking, notifying client.");
+        send(s->sync_sock, &s->total_ns, sizeof(uint64_t), 0);
+    }
+}
+
+static void stream_close(struct perftest_stream *s) {
+    if (s->c.ctx) {
+        rdmap_kill_stream(s->c.ctx);
+    }
+    if (s->sockfd >= 0) {
+        close(s->sockfd);
+    }
+    if (s->sync_sock >= 0) {
+        close(s->sync_sock);
+    }
+    if (s->c.buf && s->c.buf != MAP_FAILED) {
+        munmap(s->c.buf, s->c.buf_max);
+    }
+}
+
+void perftest_verify_read_stamp(struct perftest_context *c, uint64_t seq) {
+    if (c->is_client) {
+        perftest_pattern_fill(c->buf, c->buf_size, seq);
+    } else {
+        perftest_pattern_poison(c->buf, c->buf_size, seq);
+    }
+}
+
+int perftest_verify_read_check(struct perftest_context *c, uint64_t seq) {
+    int bad = perftest_pattern_check(c->buf, c->buf_size, seq);
+    if (bad >= 0) {
+        lwlog_err("Received incorrect value 0x%hhx for index %d, expected 0x%hhx!",
+                  c->buf[bad], bad, (char) (bad + seq));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * CPU time consumed so far by a live thread of this process, from its
+ * CPU-time clock. This is the utime+stime of /proc/self/task/<tid>/stat,
+ * but in nanoseconds rather than scheduler ticks.
+ *  returns: the time in ns, 0 if the thread cannot be read.
+ */
+static uint64_t thread_cpu_ns(pthread_t thread) {
+    clockid_t clock;
+    struct timespec ts;
+    if (pthread_getcpuclockid(thread, &clock) || clock_gettime(clock, &ts)) {
+        return 0;
+    }
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Runs every iteration of the streams this worker owns (id, id + threads,
+ * ...). Streams sharing a worker take turns, one iteration each.
+ */
+static void *worker_main(void *arg) {
+    struct perftest_worker *w = (struct perftest_worker*) arg;
+    uint64_t start_ns, end_ns;
+    pthread_barrier_wait(w->start);
+    uint64_t start_cpu = thread_cpu_ns(pthread_self());
+    for (int iter = 0; iter < w->streams[0].c.iters; iter++) {
+        for (int i = w->id; i < w->num_streams; i += w->num_threads) {
+            struct perftest_stream *s = &w->streams[i];
+            bool verify = s->c.verify_every && iter % s->c.verify_every == 0;
+            if (verify && s->c.stamp) {
+                // The peer may still be working on our previous iteration's data.
+                sync_with_remote(&s->c, s->sync_sock);
+                s->c.stamp(&s->c, s->seq);
+            }
+            sync_with_remote(&s->c, s->sync_sock);
+            lwlog_debug("stream %d iter: %d", i, iter);
+            // Nothing but the test itself between the two clock reads.
+            start_ns = get_nanos();
+            if (w->test_iter(&s->c)) {
+                lwlog_err("Test iteration failed on stream %d!", i);
+                w->ret = -1;
+                return NULL;
+            }
+            end_ns = get_nanos();
+            s->total_ns += (end_ns - start_ns);
+            if (!s->c.records_ops) {
+                perftest_hist_record(&s->lat, end_ns - start_ns);
+            }
+            if (verify && s->c.check) {
+                if (s->c.check(&s->c, s->seq)) {
+                    lwlog_err("Data check failed on stream %d, iteration %d!", i, iter);
+                    w->ret = -1;
+                    return NULL;
+                }
+                s->verified++;
+            }
+            s->seq++;
         }
-        // Complete recv.
-        if (rdmap_recv_ack(&perftest_ctx)) {
-            lwlog_err("failed to recv client info!");
+    }
+    w->cpu_ns = thread_cpu_ns(pthread_self()) - start_cpu;
+    return NULL;
+}
+
+static void report_rate(const char *what, uint64_t num_requests, int buf_size, double time_s) {
+    double Mpps = num_requests / (time_s * 1000.0 * 1000.0);
+    double MBps = (num_requests * buf_size) / (time_s * 1000.0 * 1000.0);
+    lwlog_notice("%sMessage rate (Mp/s): %f", what, Mpps);
+    lwlog_notice("%sBandwidth (MB/s): %f", what, MBps);
+}
+
+//! CPU time of the whole process, both sides with --loopback
+static double cpu_seconds(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/*
+ * Runs all iterations at one message size on every stream and logs the
+ * results.
+ *  returns: 0 on success, PERFTEST_SKIP if the test cannot run this size,
+ *           -1 on failure.
+ */
+static int run_size(struct perftest_stream *streams, int nstreams, int nthreads, int size,
+                    int (*test_init)(perftest_context*, uint32_t, struct send_data*),
+                    int (*test_iter)(perftest_context*),
+                    void (*test_fini)(perftest_context*, float),
+                    struct perftest_result *res) {
+    int iters = streams[0].c.iters;
+    for (int i = 0; i < nstreams; i++) {
+        int ret = stream_prepare(&streams[i], size, test_init);
+        if (ret) {
+            for (int j = 0; j < i; j++) {
+                test_fini(&streams[j].c, 0);
+            }
+            if (ret != PERFTEST_SKIP) {
+                lwlog_err("Test initialization failed!");
+            }
+            return ret == PERFTEST_SKIP ? PERFTEST_SKIP : -1;
         }
-        lwlog_debug("Received addr %p stag %lu and size %lu from client.", (void*)their_sd.offset, their_sd.stag, their_sd.size);
     }
 
-    /* BEGIN BENCHMARKING */
-    if (test_init(&perftest_ctx, stag, &their_sd)) {
-        lwlog_err("Test initialization failed!");
-        goto cleanup;
-    }
-    for (int iter = 0; iter < perftest_ctx.iters; iter++) {
-        sync_with_remote(&perftest_ctx, sync_sock);
-        start_ns = get_nanos();
-        lwlog_debug("iter: %d", iter);
-        if (test_iter(&perftest_ctx)) {
-            lwlog_err("Test iteration failed!");
-            goto cleanup;
+    struct perftest_worker *workers = (struct perftest_worker*) calloc(nthreads, sizeof(*workers));
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (int t = 0; t < nthreads; t++) {
+        struct perftest_worker *w = &workers[t];
+        w->id = t;
+        w->streams = streams;
+        w->num_streams = nstreams;
+        w->num_threads = nthreads;
+        w->start = &start;
+        w->test_iter = test_iter;
+        if (pthread_create(&w->thread, NULL, worker_main, w)) {
+            // Workers already waiting on the barrier would never be released.
+            lwlog_err("Failed to start worker thread %d!", t);
+            exit(1);
         }
-        end_ns = get_nanos();
-        lwlog_notice("iter time: %lu", end_ns-start_ns);
-        total_ns += (end_ns - start_ns);
+    }
+    // The library threads run for the life of the stream, so they are
+    // sampled around the timed loop rather than from inside it.
+    uint64_t *lib_cpu_ns = (uint64_t*) calloc(2 * nstreams, sizeof(uint64_t));
+    pthread_barrier_wait(&start);
+    uint64_t start_ns = get_nanos();
+    uint64_t start_tsc = __rdtsc();
+    double start_cpu = cpu_seconds();
+    uint64_t start_self_ns = thread_cpu_ns(pthread_self());
+    for (int i = 0; i < nstreams; i++) {
+        lib_cpu_ns[2 * i] = thread_cpu_ns(streams[i].c.ctx->send_thread);
+        lib_cpu_ns[2 * i + 1] = thread_cpu_ns(streams[i].c.ctx->recv_thread);
+    }
+    bool failed = false;
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        failed |= workers[t].ret != 0;
+    }
+    for (int i = 0; i < nstreams; i++) {
+        // A thread that already exited (peer hung up) reads as 0, count nothing.
+        uint64_t send_ns = thread_cpu_ns(streams[i].c.ctx->send_thread);
+        uint64_t recv_ns = thread_cpu_ns(streams[i].c.ctx->recv_thread);
+        lib_cpu_ns[2 * i] = send_ns > lib_cpu_ns[2 * i] ? send_ns - lib_cpu_ns[2 * i] : 0;
+        lib_cpu_ns[2 * i + 1] = recv_ns > lib_cpu_ns[2 * i + 1] ? recv_ns - lib_cpu_ns[2 * i + 1] : 0;
+    }
+    uint64_t app_cpu_ns = thread_cpu_ns(pthread_self()) - start_self_ns;
+    double process_cpu_s = cpu_seconds() - start_cpu;
+    uint64_t end_tsc = __rdtsc();
+    uint64_t end_ns = get_nanos();
+    for (int t = 0; t < nthreads; t++) {
+        app_cpu_ns += workers[t].cpu_ns;
+    }
+    pthread_barrier_destroy(&start);
+    free(workers);
+    if (failed) {
+        free(lib_cpu_ns);
+        return -1;
     }
 
-    if (perftest_ctx.is_client) {
-        lwlog_info("Waiting for server finished notification ...");
-        if (rdmap_recv_issue(&perftest_ctx, (void*)&total_ns, sizeof(uint64_t), recv_wr)) {
-            lwlog_err("failed to issue recv for server completion!");
+    struct perftest_hist lat;
+    perftest_hist_init(&lat);
+    for (int i = 0; i < nstreams; i++) {
+        stream_swap_time(&streams[i]);
+        perftest_hist_merge(&lat, &streams[i].lat);
+    }
+
+    // Workers run side by side, so their rates add up.
+    uint64_t total_msgs = 0;
+    double aggregate_Mpps = 0, tx_Mpps = 0, rx_Mpps = 0;
+    for (int t = 0; t < nthreads; t++) {
+        uint64_t msgs = 0, ns = 0, tx_ns = 0, rx_ns = 0;
+        for (int i = t; i < nstreams; i += nthreads) {
+            msgs += streams[i].c.msgs_per_iter * iters;
+            ns += streams[i].total_ns;
+            tx_ns += streams[i].c.tx_ns;
+            rx_ns += streams[i].c.rx_ns;
+            // Latency tests move one message per iteration.
+            total_msgs += streams[i].c.msgs_per_iter ? streams[i].c.msgs_per_iter * iters : iters;
+        }
+        if (ns) {
+            aggregate_Mpps += msgs * 1000.0 / ns;
+        }
+        // Bidirectional tests count both ways in msgs_per_iter.
+        if (tx_ns && rx_ns) {
+            tx_Mpps += msgs / 2 * 1000.0 / tx_ns;
+            rx_Mpps += msgs / 2 * 1000.0 / rx_ns;
         }
-        sync_with_remote(&perftest_ctx, sync_sock);
-        rdmap_recv_ack(&perftest_ctx);
-    } else {
-        send_wr.wr_id = 234;
-        lwlog_info("Finished benchmarking, notifying client.");
-        sync_with_remote(&perftest_ctx, sync_sock);
-        rdmap_send_data(&perftest_ctx, (void*)&total_ns, sizeof(uint64_t), send_wr);
     }
+    double wall_s = (end_ns - start_ns)/(1000.0 * 1000.0 * 1000.0);
+
+    // CPU time is turned into cycles at the TSC rate over the same interval,
+    // i.e. reference cycles, not what a boosted or throttled core retired.
+    uint64_t send_cpu_ns = 0, recv_cpu_ns = 0;
+    for (int i = 0; i < nstreams; i++) {
+        send_cpu_ns += lib_cpu_ns[2 * i];
+        recv_cpu_ns += lib_cpu_ns[2 * i + 1];
+    }
+    double cpu_s = (app_cpu_ns + send_cpu_ns + recv_cpu_ns) / (1000.0 * 1000.0 * 1000.0);
+    double tsc_hz = (end_tsc - start_tsc) / wall_s;
+    double cycles_per_msg = cpu_s * tsc_hz / total_msgs;
+    // CPU ns that make up 1% of one core over the run
+    double ns_per_pct = (end_ns - start_ns) / 100.0;
 
     // Print results.
-    float time_s;
     lwlog_notice("Completed test!");
-    time_s = (total_ns/(1000.0 * 1000.0 * 1000.0));
-    lwlog_notice("Total Time (s): %f", time_s);
-    lwlog_notice("Time per iteration (us): %f", (total_ns/1000.0/perftest_ctx.iters));
-    lwlog_notice("One-way latency (us): %f", (total_ns/1000.0/perftest_ctx.iters/2));
+    if (streams[0].c.buf_max != size) {
+        lwlog_notice("Message size (B): %d", size);
+    }
+    double offered_Mpps = streams[0].c.offered_rate * nstreams / (1000.0 * 1000.0);
+    if (offered_Mpps > 0) {
+        lwlog_notice("Offered load (Mp/s): %f", offered_Mpps);
+    }
+    if (nstreams == 1) {
+        float time_s = (streams[0].total_ns/(1000.0 * 1000.0 * 1000.0));
+        lwlog_notice("Total Time (s): %f", time_s);
+        lwlog_notice("Time per iteration (us): %f", (streams[0].total_ns/1000.0/iters));
+        lwlog_notice("One-way latency (us): %f", (streams[0].total_ns/1000.0/iters/2));
+        if (streams[0].c.msgs_per_iter) {
+            report_rate("", streams[0].c.msgs_per_iter * iters, size, time_s);
+        }
+    } else {
+        for (int i = 0; i < nstreams; i++) {
+            struct perftest_stream *s = &streams[i];
+            double time_s = s->total_ns/(1000.0 * 1000.0 * 1000.0);
+            char what[32];
+            snprintf(what, sizeof(what), "Stream %d: ", i);
+            lwlog_notice("%sTime (s): %f", what, time_s);
+            if (s->c.msgs_per_iter) {
+                report_rate(what, s->c.msgs_per_iter * iters, size, time_s);
+            }
+        }
+        lwlog_notice("Streams: %d, threads: %d, wall time (s): %f", nstreams, nthreads, wall_s);
+        if (aggregate_Mpps > 0) {
+            lwlog_notice("Aggregate message rate (Mp/s): %f", aggregate_Mpps);
+            lwlog_notice("Aggregate bandwidth (MB/s): %f", aggregate_Mpps * size);
+        }
+    }
+    if (tx_Mpps > 0) {
+        lwlog_notice("Send direction bandwidth (MB/s): %f", tx_Mpps * size);
+        lwlog_notice("Receive direction bandwidth (MB/s): %f", rx_Mpps * size);
+    }
+    perftest_hist_print(&lat, streams[0].c.records_ops ? "Operation latency" : "Iteration latency");
+    // Only the checking side has anything to report.
+    if (streams[0].c.verify_every && streams[0].c.check) {
+        int verified = 0;
+        for (int i = 0; i < nstreams; i++) {
+            verified += streams[i].verified;
+        }
+        lwlog_notice("Data verified: %d of %d iterations", verified, iters * nstreams);
+    }
+    lwlog_notice("CPU utilization (%% of one core): %f", 100.0 * cpu_s / wall_s);
+    lwlog_notice("  perftest threads: %f, rnic_send: %f, rnic_recv: %f",
+                 app_cpu_ns / ns_per_pct, send_cpu_ns / ns_per_pct, recv_cpu_ns / ns_per_pct);
+    if (nstreams > 1) {
+        for (int i = 0; i < nstreams; i++) {
+            lwlog_notice("  Stream %d: rnic_send: %f, rnic_recv: %f", i,
+                         lib_cpu_ns[2 * i] / ns_per_pct, lib_cpu_ns[2 * i + 1] / ns_per_pct);
+        }
+    }
+    if (streams[0].c.loopback) {
+        lwlog_notice("Process CPU utilization, both sides (%% of one core): %f", 100.0 * process_cpu_s / wall_s);
+    }
+    lwlog_notice("Cycles per message: %f", cycles_per_msg);
+    lwlog_notice("Cycles per byte: %f", cycles_per_msg / size);
+    free(lib_cpu_ns);
+
+    res->size = size;
+    res->offered_Mpps = offered_Mpps;
+    res->time_s = nstreams == 1 ? streams[0].total_ns/(1000.0 * 1000.0 * 1000.0) : wall_s;
+    res->Mpps = aggregate_Mpps;
+    res->MBps = aggregate_Mpps * size;
+    res->tx_MBps = tx_Mpps * size;
+    res->rx_MBps = rx_Mpps * size;
+    res->cpu_pct = 100.0 * cpu_s / wall_s;
+    res->cpu_app_pct = app_cpu_ns / ns_per_pct;
+    res->cpu_send_pct = send_cpu_ns / ns_per_pct;
+    res->cpu_recv_pct = recv_cpu_ns / ns_per_pct;
+    res->cycles_per_msg = cycles_per_msg;
+    res->cycles_per_byte = cycles_per_msg / size;
+    res->lat_us[0] = lat.count ? lat.min / 1000.0 : 0;
+    res->lat_us[1] = lat.count ? (double) lat.sum / lat.count / 1000.0 : 0;
+    res->lat_us[2] = perftest_hist_percentile(&lat, 50) / 1000.0;
+    res->lat_us[3] = perftest_hist_percentile(&lat, 99) / 1000.0;
+    res->lat_us[4] = perftest_hist_percentile(&lat, 99.9) / 1000.0;
+    res->lat_us[5] = lat.max / 1000.0;
+
+    for (int i = 0; i < nstreams; i++) {
+        test_fini(&streams[i].c, (streams[i].total_ns/(1000.0 * 1000.0 * 1000.0)));
+    }
+    return 0;
+}
 
-    test_fini(&perftest_ctx, time_s);
+//! Results of one side, as printed by print_results
+struct perftest_side_results {
+    const struct perftest_context *c;
+    struct perftest_result *res;
+    int nres;
+};
+
+/*
+ * Prints the results table to stdout, for scripts rather than people. With
+ * both sides in one process (--loopback) the CSV has rows from each, and
+ * the JSON is an array of the two documents.
+ */
+static void print_results(const char *test, const struct perftest_side_results *sides, int nsides) {
+    static const char *lat_names[] = {"lat_min_us", "lat_mean_us", "lat_p50_us",
+                                      "lat_p99_us", "lat_p999_us", "lat_max_us"};
+    bool json = !strcmp(sides[0].c->format, "json");
+    if (json && nsides > 1) {
+        printf("[");
+    } else if (!json) {
+        printf("test,side,streams,threads,iters,size,offered_mpps,time_s,msg_rate_mpps,bw_mbps,tx_mbps,rx_mbps");
+        for (int j = 0; j < 6; j++) {
+            printf(",%s", lat_names[j]);
+        }
+        printf(",cpu_pct,cpu_app_pct,cpu_rnic_send_pct,cpu_rnic_recv_pct,cycles_per_msg,cycles_per_byte\n");
+    }
+    for (int k = 0; k < nsides; k++) {
+        const struct perftest_context *c = sides[k].c;
+        const char *side = c->is_client ? "client" : "server";
+        if (json) {
+            printf("%s{\"test\": \"%s\", \"side\": \"%s\", \"streams\": %d, \"threads\": %d, \"iters\": %d, \"results\": [",
+                   k ? ",\n" : "", test, side, c->num_streams, c->num_threads, c->iters);
+        }
+        for (int i = 0; i < sides[k].nres; i++) {
+            const struct perftest_result *r = &sides[k].res[i];
+            if (json) {
+                printf("%s\n  {\"size\": %d, \"offered_mpps\": %f, \"time_s\": %f, \"msg_rate_mpps\": %f"
+                       ", \"bw_mbps\": %f, \"tx_mbps\": %f, \"rx_mbps\": %f", i ? "," : "", r->size,
+                       r->offered_Mpps, r->time_s, r->Mpps, r->MBps, r->tx_MBps, r->rx_MBps);
+                for (int j = 0; j < 6; j++) {
+                    printf(", \"%s\": %.3f", lat_names[j], r->lat_us[j]);
+                }
+                printf(", \"cpu_pct\": %.1f, \"cpu_app_pct\": %.1f, \"cpu_rnic_send_pct\": %.1f"
+                       ", \"cpu_rnic_recv_pct\": %.1f, \"cycles_per_msg\": %.1f, \"cycles_per_byte\": %.3f}",
+                       r->cpu_pct, r->cpu_app_pct, r->cpu_send_pct, r->cpu_recv_pct,
+                       r->cycles_per_msg, r->cycles_per_byte);
+            } else {
+                printf("%s,%s,%d,%d,%d,%d,%f,%f,%f,%f,%f,%f", test, side, c->num_streams, c->num_threads,
+                       c->iters, r->size, r->offered_Mpps, r->time_s, r->Mpps, r->MBps, r->tx_MBps, r->rx_MBps);
+                for (int j = 0; j < 6; j++) {
+                    printf(",%.3f", r->lat_us[j]);
+                }
+                printf(",%.1f,%.1f,%.1f,%.1f,%.1f,%.3f\n", r->cpu_pct, r->cpu_app_pct,
+                       r->cpu_send_pct, r->cpu_recv_pct, r->cycles_per_msg, r->cycles_per_byte);
+            }
+        }
+        if (json) {
+            printf("\n]}");
+        }
+    }
+    if (json) {
+        printf(nsides > 1 ? "]\n" : "\n");
+    }
+    fflush(stdout);
+}
+
+/*
+ * Runs one side of the test, the client or the server per c->is_client.
+ * The results table is left in `out` for print_results, the caller frees it.
+ *  returns: 0 on success, -1 on failure.
+ */
+static int perftest_side(struct perftest_context *c, struct perftest_side_results *out,
+                         int (*test_init)(perftest_context*, uint32_t, struct send_data*),
+                         int (*test_iter)(perftest_context*),
+                         void (*test_fini)(perftest_context*, float))
+{
+    struct perftest_context &perftest_ctx = *c;
+    int ret = -1;
+    int nstreams = perftest_ctx.num_streams;
+    int nthreads = perftest_ctx.num_threads < nstreams ? perftest_ctx.num_threads : nstreams;
+
+    struct perftest_stream *streams = (struct perftest_stream*) calloc(nstreams, sizeof(*streams));
+    // A sweep runs every power of two up to -b on the same connections.
+    int first_size = perftest_ctx.sweep ? 1 : perftest_ctx.buf_size;
+    int nsizes = 0;
+    for (int size = first_size; size > 0 && size <= perftest_ctx.buf_size; size *= 2) {
+        nsizes++;
+    }
+    // With --rate, each size is run at every load step up to the peak rate.
+    int nsteps = perftest_ctx.rate > 0 ? perftest_ctx.load_steps : 1;
+    struct perftest_result *results = (struct perftest_result*) calloc(nsizes * nsteps, sizeof(*results));
+    int nresults = 0;
+    int opened = 0;
+
+    // Streams are connected one at a time, in the same order on both sides.
+    for (; opened < nstreams; opened++) {
+        if (stream_open(&perftest_ctx, &streams[opened], opened)) {
+            opened++;
+            goto cleanup;
+        }
+    }
+
+    /* BEGIN BENCHMARKING */
+    for (int size = first_size; size > 0 && size <= perftest_ctx.buf_size; size *= 2) {
+        for (int step = 1; step <= nsteps; step++) {
+            for (int i = 0; i < nstreams; i++) {
+                streams[i].c.offered_rate = perftest_ctx.rate * step / nsteps;
+            }
+            int ret = run_size(streams, nstreams, nthreads, size, test_init, test_iter, test_fini,
+                               &results[nresults]);
+            if (ret == PERFTEST_SKIP && perftest_ctx.sweep) {
+                lwlog_info("Skipping %d byte messages, too small for this test.", size);
+                break;
+            } else if (ret) {
+                goto cleanup;
+            }
+            nresults++;
+        }
+    }
+    ret = 0;
 
     // Cleanup.
 cleanup:
-    rdmap_kill_stream(perftest_ctx.ctx);
-    close(sockfd);
-    close(sync_sock);
-    munmap(perftest_ctx.buf, perftest_ctx.buf_size);
-    if (!perftest_ctx.is_client) {
+    for (int i = 0; i < opened; i++) {
+        stream_close(&streams[i]);
+    }
+    out->c = c;
+    out->res = results;
+    out->nres = nresults;
+    free(streams);
+    if (!perftest_ctx.is_client && perftest_ctx.serverfd >= 0) {
         int flags = 1;
         setsockopt(perftest_ctx.serverfd, SOL_SOCKET, SO_REUSEADDR, &flags, sizeof(int));
         close(perftest_ctx.serverfd);
     }
+    return ret;
+}
+
+struct loopback_server {
+    struct perftest_context c;
+    struct perftest_side_results out;
+    int (*test_init)(perftest_context*, uint32_t, struct send_data*);
+    int (*test_iter)(perftest_context*);
+    void (*test_fini)(perftest_context*, float);
+    int ret;
+};
+
+static void *loopback_server_main(void *arg) {
+    struct loopback_server *srv = (struct loopback_server*) arg;
+    srv->ret = perftest_side(&srv->c, &srv->out, srv->test_init, srv->test_iter, srv->test_fini);
+    return NULL;
+}
+
+void perftest_run(int argc, char **argv, 
+                  int (*test_init)(perftest_context*, uint32_t, struct send_data*),
+                  int (*test_iter)(perftest_context*),
+                  void (*test_fini)(perftest_context*, float))
+{
+    //! Parse arguments.
+    struct perftest_context perftest_ctx;
+    perftest_ctx.serverfd = -1;
+    if (perftest_argparse(argc, argv, &perftest_ctx)) {
+        lwlog_err("Failed to parse arguments!");
+        lwlog_notice("Run with -h to see command-line usage.");
+        return;
+    }
+    const char *test = strrchr(argv[0], '/');
+    test = test ? test + 1 : argv[0];
+    struct perftest_side_results sides[2];
+    if (!perftest_ctx.loopback) {
+        if (!perftest_side(&perftest_ctx, &sides[0], test_init, test_iter, test_fini) && perftest_ctx.format) {
+            print_results(test, sides, 1);
+        }
+        free(sides[0].res);
+        return;
+    }
+
+    /*
+     * Loopback: the server runs on its own thread, the client on this one,
+     * over socketpairs instead of TCP. Each stream takes a data and a sync
+     * socket, in the order stream_open asks for them.
+     */
+    int nfds = 2 * perftest_ctx.num_streams;
+    int *server_fds = (int*) calloc(nfds, sizeof(int));
+    int *client_fds = (int*) calloc(nfds, sizeof(int));
+    for (int i = 0; i < nfds; i++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) {
+            perror("socketpair");
+            exit(1);
+        }
+        server_fds[i] = pair[0];
+        client_fds[i] = pair[1];
+    }
+    struct loopback_server srv;
+    srv.c = perftest_ctx;
+    srv.c.is_client = false;
+    srv.c.loop_fds = server_fds;
+    srv.c.loop_next = 0;
+    srv.test_init = test_init;
+    srv.test_iter = test_iter;
+    srv.test_fini = test_fini;
+    pthread_t server_thread;
+    if (pthread_create(&server_thread, NULL, loopback_server_main, &srv)) {
+        lwlog_err("Failed to start the loopback server!");
+        exit(1);
+    }
+    perftest_ctx.is_client = true;
+    perftest_ctx.loop_fds = client_fds;
+    perftest_ctx.loop_next = 0;
+    int ret = perftest_side(&perftest_ctx, &sides[1], test_init, test_iter, test_fini);
+    pthread_join(server_thread, NULL);
+    sides[0] = srv.out;
+    if (!ret && !srv.ret && perftest_ctx.format) {
+        print_results(test, sides, 2);
+    }
+    free(sides[0].res);
+    free(sides[1].res);
+    free(server_fds);
+    free(client_fds);
 }
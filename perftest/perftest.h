@@ -31,27 +31,85 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
+#include <sched.h>
 
 #include "lwlog.h"
-
-//#define PERFTEST_TEST
+#include "histogram.h"
+#include "verify.h"
 
 #define DEFAULT_BUF_SIZE 1024
 #define DEFAULT_ITERS 1024
 #define DEFAULT_IP "127.0.0.1"
 #define DEFAULT_PORT "9999"
 #define DEFAULT_MAX_REQS 1024
+#define DEFAULT_LOAD_STEPS 10
+
+//! test_init's return for a message size the test cannot run, skipped by -a
+#define PERFTEST_SKIP 1
 
 struct perftest_context {
     char *port; 
     char *ip;
+    //! Current message size, below buf_max while sweeping (-a)
     int buf_size;
+    //! Bytes mapped at buf
+    int buf_max;
     char *buf;
     int iters;
     int max_reqs;
     bool is_client;
     int serverfd;
     int huge_shmid;
+    //! Progress thread CPUs (-C), used if num_cpus > 0
+    cpu_set_t cpus;
+    int num_cpus;
+    //! NUMA node for the stream and the test buffer (-N), -1 for any
+    int numa_node;
+    //! Streams to open (-q) and threads driving them (-t)
+    int num_streams;
+    int num_threads;
+    //! Sweep all sizes up to -b (-a), and the results format (-f), or NULL
+    bool sweep;
+    const char *format;
+    //! Both sides in one process (--loopback), connected by loop_fds
+    bool loopback;
+    int *loop_fds;
+    int loop_next;
+    //! Which stream this context belongs to, from 0
+    int stream_id;
+    //! Per-stream test state, owned by the test
+    void *priv;
+    //! Receives the test left posted, still there when test_init runs for the next size
+    int recvs_posted;
+    //! Messages each test_iter moves, set by bandwidth tests for rate reporting
+    uint64_t msgs_per_iter;
+    //! Latency samples, one per iteration unless the test records its own
+    struct perftest_hist *lat;
+    //! Set by test_init when test_iter times individual operations itself
+    bool records_ops;
+    //! Open-loop tests: peak offered load per stream in ops/s (--rate), 0 if
+    //! unset, reached in load_steps equal steps (--load-steps)
+    double rate;
+    int load_steps;
+    //! Exponential gaps between operations (--poisson) instead of fixed ones
+    bool poisson;
+    //! Offered load of the current step in ops/s per stream, 0 without --rate
+    double offered_rate;
+    //! Both sides send at once (-B), in the tests that support it
+    bool bidir;
+    //! Bidirectional tests: time spent until this side's sends had all
+    //! completed, and until the peer's had all arrived, summed over iterations
+    uint64_t tx_ns;
+    uint64_t rx_ns;
+    //! Check the data on every verify_every-th iteration (--verify), 0 never
+    int verify_every;
+    //! Set by test_init if the test supports --verify. On iterations being
+    //! checked, stamp runs between the peer finishing the previous iteration
+    //! and this one starting, and check runs after it, both outside the timed
+    //! region. seq is the same on both sides.
+    void (*stamp)(perftest_context*, uint64_t seq);
+    int (*check)(perftest_context*, uint64_t seq);
     struct rdmap_stream_context* ctx;
 };
 
@@ -61,6 +119,20 @@ struct send_data {
     uint64_t size;
 };
 
+static inline uint64_t get_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+//! Records one operation that started at `start_ns`, see records_ops
+static inline void perftest_record_op(struct perftest_context *c, uint64_t start_ns) {
+    perftest_hist_record(c->lat, get_nanos() - start_ns);
+}
+
+//! Parses the common command line into `c`, 0 on success
+int perftest_argparse(int argc, char **argv, struct perftest_context *c);
+
 void perftest_run(int argc, char **argv, 
                   int (*test_init)(perftest_context*, uint32_t, struct send_data*), 
                   int (*test_iter)(perftest_context*),
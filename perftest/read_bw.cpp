@@ -27,26 +27,38 @@
 #include "perftest.h"
 #include "rdmap/rdmap.h"
 
-struct sge read_sg;
-struct send_wr read_wr;
+struct read_bw_state {
+    struct sge read_sg;
+    struct send_wr read_wr;
+};
 
 int read_bw_init(perftest_context *perftest_ctx, uint32_t lstag, struct send_data *sd) {
+    struct read_bw_state *st = (struct read_bw_state*) calloc(1, sizeof(*st));
+    if (!st) {
+        return -1;
+    }
+    perftest_ctx->priv = st;
+    perftest_ctx->msgs_per_iter = perftest_ctx->max_reqs;
     // Build read WR.
-    read_sg.addr = (uint64_t) perftest_ctx->buf;
-    read_sg.length = perftest_ctx->buf_size;
-    read_sg.lkey = lstag;
-    read_wr.wr_id = 2;
-    read_wr.sg_list = &read_sg;
-    read_wr.num_sge = 1;
-    read_wr.opcode = RDMAP_RDMA_READ_REQ;
-    read_wr.wr.rdma.rkey = sd->stag;
-    read_wr.wr.rdma.remote_addr = sd->offset;
+    st->read_sg.addr = (uint64_t) perftest_ctx->buf;
+    st->read_sg.length = perftest_ctx->buf_size;
+    st->read_sg.lkey = lstag;
+    st->read_wr.wr_id = 2;
+    st->read_wr.sg_list = &st->read_sg;
+    st->read_wr.num_sge = 1;
+    st->read_wr.opcode = RDMAP_RDMA_READ_REQ;
+    st->read_wr.wr.rdma.rkey = sd->stag;
+    st->read_wr.wr.rdma.remote_addr = sd->offset;
     // Fill the client's region with incrementing values.
     if (perftest_ctx->is_client) {
         for (int i = 0; i < perftest_ctx->buf_size; i++) {
             perftest_ctx->buf[i] = (char) i;
         }
     }
+    perftest_ctx->stamp = perftest_verify_read_stamp;
+    if (!perftest_ctx->is_client) {
+        perftest_ctx->check = perftest_verify_read_check;
+    }
     return 0;
 }
 
@@ -56,10 +68,11 @@ int read_bw_iter(perftest_context *perftest_ctx) {
         return 0;
     }
     // Server issues reads to client.
+    struct read_bw_state *st = (struct read_bw_state*) perftest_ctx->priv;
     int ret;
     for (int i = 0; i < perftest_ctx->max_reqs; i++) {
-        ret = rdmap_read(perftest_ctx->ctx, read_wr);
-        read_wr.wr_id++;
+        ret = rdmap_read(perftest_ctx->ctx, st->read_wr);
+        st->read_wr.wr_id++;
         if (ret < 0) {
             lwlog_err("Failed to issue RDMA READ!");
             return -1;
@@ -79,24 +92,11 @@ int read_bw_iter(perftest_context *perftest_ctx) {
             return -1;
         }
     }
-#ifdef PERFTEST_TEST
-    for (int i = 0; i < perftest_ctx->buf_size; i++) {
-        if (perftest_ctx->buf[i] != ((char) i)) {
-            lwlog_err("Received incorrect value 0x%hhx for index %d!", perftest_ctx->buf[i], i);
-            return -1;
-        }
-    }
-    memset(perftest_ctx->buf, 0, perftest_ctx->buf_size);
-#endif // PERFTEST_TEST
     return 0;
 }
 
 void read_bw_fini(perftest_context *perftest_ctx, float time_s) {
-    uint64_t num_requests = perftest_ctx->max_reqs * perftest_ctx->iters;
-    float Mpps = num_requests / (time_s * 1000.0 * 1000.0);
-    float MBps = (num_requests * perftest_ctx->buf_size) / (time_s * 1000.0 * 1000.0);
-    lwlog_notice("Message rate (Mp/s): %f", Mpps);
-    lwlog_notice("Bandwidth (MB/s): %f", MBps);
+    free(perftest_ctx->priv);
 }
 
 int main(int argc, char **argv) {
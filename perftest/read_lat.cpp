@@ -27,37 +27,52 @@
 #include "perftest.h"
 #include "rdmap/rdmap.h"
 
-struct sge read_sg;
-struct send_wr read_wr;
+struct read_lat_state {
+    struct sge read_sg;
+    struct send_wr read_wr;
+};
 
 int read_lat_init(perftest_context *perftest_ctx, uint32_t lstag, struct send_data *sd) {
+    struct read_lat_state *st = (struct read_lat_state*) calloc(1, sizeof(*st));
+    if (!st) {
+        return -1;
+    }
+    perftest_ctx->priv = st;
     // Build read WR.
-    read_sg.addr = (uint64_t) perftest_ctx->buf;
-    read_sg.length = perftest_ctx->buf_size;
-    read_sg.lkey = lstag;
-    read_wr.wr_id = 2;
-    read_wr.sg_list = &read_sg;
-    read_wr.num_sge = 1;
-    read_wr.opcode = RDMAP_RDMA_READ_REQ;
-    read_wr.wr.rdma.rkey = sd->stag;
-    read_wr.wr.rdma.remote_addr = sd->offset;
+    st->read_sg.addr = (uint64_t) perftest_ctx->buf;
+    st->read_sg.length = perftest_ctx->buf_size;
+    st->read_sg.lkey = lstag;
+    st->read_wr.wr_id = 2;
+    st->read_wr.sg_list = &st->read_sg;
+    st->read_wr.num_sge = 1;
+    st->read_wr.opcode = RDMAP_RDMA_READ_REQ;
+    st->read_wr.wr.rdma.rkey = sd->stag;
+    st->read_wr.wr.rdma.remote_addr = sd->offset;
     // Fill the client's region with incrementing values.
     if (perftest_ctx->is_client) {
         for (int i = 0; i < perftest_ctx->buf_size; i++) {
             perftest_ctx->buf[i] = (char) i;
         }
     }
+    perftest_ctx->stamp = perftest_verify_read_stamp;
+    if (!perftest_ctx->is_client) {
+        perftest_ctx->check = perftest_verify_read_check;
+    }
+    // Only the server's reads are timed, the client just serves them.
+    perftest_ctx->records_ops = true;
     return 0;
 }
 
 int read_lat_iter(perftest_context *perftest_ctx) {
+    struct read_lat_state *st = (struct read_lat_state*) perftest_ctx->priv;
     // Client does nothing.
     if (perftest_ctx->is_client) {
         return 0;
     }
     // Server issues reads to client.
     int ret;
-    ret = rdmap_read(perftest_ctx->ctx, read_wr);
+    uint64_t start_ns = get_nanos();
+    ret = rdmap_read(perftest_ctx->ctx, st->read_wr);
     if (ret < 0) {
         lwlog_err("Failed to issue RDMA READ!");
         return -1;
@@ -66,6 +81,7 @@ int read_lat_iter(perftest_context *perftest_ctx) {
     struct work_completion wc;
     auto read_cq = perftest_ctx->ctx->send_q->cq->q;
     do { ret = read_cq->try_dequeue(wc); } while (!ret) ;
+    perftest_record_op(perftest_ctx, start_ns);
     lwlog_debug("received completion");
     if (wc.status != WC_SUCCESS) {
         lwlog_err("Received remote send with error");
@@ -74,19 +90,12 @@ int read_lat_iter(perftest_context *perftest_ctx) {
         lwlog_err("Received wrong message type!");
         return -1;
     }
-#ifdef PERFTEST_TEST
-    for (int i = 0; i < perftest_ctx->buf_size; i++) {
-        if (perftest_ctx->buf[i] != ((char) i)) {
-            lwlog_err("Received incorrect value 0x%hhx for index %d!", perftest_ctx->buf[i], i);
-            return -1;
-        }
-    }
-    memset(perftest_ctx->buf, 0, perftest_ctx->buf_size);
-#endif // PERFTEST_TEST
     return 0;
 }
 
-void read_lat_fini(perftest_context *perftest_ctx, float time_s) {}
+void read_lat_fini(perftest_context *perftest_ctx, float time_s) {
+    free(perftest_ctx->priv);
+}
 
 int main(int argc, char **argv) {
     perftest_run(argc, argv, read_lat_init, read_lat_iter, read_lat_fini);
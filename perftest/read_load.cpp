@@ -0,0 +1,232 @@
+/*
+ * Software Userspace iWARP device driver for Linux 
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2021 Saksham Goel, Matthew Pabst
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Open-loop RDMA Read latency. Each iteration, an issuer thread started
+ * once up front issues -r reads on a fixed schedule at the offered rate
+ * (--rate, stepped by --load-steps) and does not wait for them to
+ * complete. The test thread reaps the completions. Each read's latency
+ * counts from the time it was scheduled rather than the time it was
+ * posted. A stall that holds back later reads is therefore charged to
+ * them too, which corrects for coordinated omission. Past saturation the
+ * achieved rate falls behind the offered one and the percentiles climb.
+ */
+
+#include <math.h>
+#include <pthread.h>
+
+#include "perftest.h"
+#include "rdmap/rdmap.h"
+
+struct read_load_state {
+    struct sge read_sg;
+    struct send_wr read_wr;
+    //! When each of the iteration's reads is due, ns
+    uint64_t *sched;
+    perftest_context *c;
+    uint64_t rng;
+    int ret;
+    //! Issuer handshake: iterations asked for, iterations issued
+    pthread_t issuer;
+    bool started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t gen;
+    uint64_t done;
+    bool stop;
+};
+
+//! xorshift64*, in (0, 1]
+static double next_uniform(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((*state * 0x2545f4914f6cdd1dull) >> 11) * (1.0 / 9007199254740992.0) + 1.0 / 9007199254740992.0;
+}
+
+/*
+ * Waits for each iteration, fixes its schedule as soon as it wakes up so
+ * the wakeup is not charged to the reads, and posts each read once its
+ * time comes, late ones right away.
+ */
+static void *read_load_issue(void *arg) {
+    struct read_load_state *st = (struct read_load_state*) arg;
+    perftest_context *c = st->c;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&st->lock);
+    for (;;) {
+        while (st->gen == seen && !st->stop) {
+            pthread_cond_wait(&st->cond, &st->lock);
+        }
+        if (st->stop) {
+            break;
+        }
+        seen = st->gen;
+        pthread_mutex_unlock(&st->lock);
+
+        double gap_ns = 1e9 / c->offered_rate;
+        double due = get_nanos();
+        for (int i = 0; i < c->max_reqs; i++) {
+            st->sched[i] = (uint64_t) due;
+            due += c->poisson ? -log(next_uniform(&st->rng)) * gap_ns : gap_ns;
+        }
+        for (int i = 0; i < c->max_reqs; i++) {
+            while (get_nanos() < st->sched[i]) ;
+            st->read_wr.wr_id = i;
+            if (rdmap_read(c->ctx, st->read_wr) < 0) {
+                lwlog_err("Failed to issue RDMA READ!");
+                __atomic_store_n(&st->ret, -1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&st->lock);
+        st->done = seen;
+        pthread_cond_broadcast(&st->cond);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+int read_load_init(perftest_context *perftest_ctx, uint32_t lstag, struct send_data *sd) {
+    if (perftest_ctx->offered_rate <= 0) {
+        lwlog_err("read_load needs an offered load, see --rate.");
+        return -1;
+    }
+    struct read_load_state *st = (struct read_load_state*) calloc(1, sizeof(*st));
+    if (!st) {
+        return -1;
+    }
+    perftest_ctx->priv = st;
+    perftest_ctx->msgs_per_iter = perftest_ctx->max_reqs;
+    // Reads are timed one by one, on the server.
+    perftest_ctx->records_ops = true;
+    st->c = perftest_ctx;
+    st->sched = (uint64_t*) calloc(perftest_ctx->max_reqs, sizeof(uint64_t));
+    if (!st->sched) {
+        free(st);
+        perftest_ctx->priv = NULL;
+        return -1;
+    }
+    st->rng = 0x9e3779b97f4a7c15ull * (perftest_ctx->stream_id + 1) ^ get_nanos();
+    // Build read WR.
+    st->read_sg.addr = (uint64_t) perftest_ctx->buf;
+    st->read_sg.length = perftest_ctx->buf_size;
+    st->read_sg.lkey = lstag;
+    st->read_wr.sg_list = &st->read_sg;
+    st->read_wr.num_sge = 1;
+    st->read_wr.opcode = RDMAP_RDMA_READ_REQ;
+    st->read_wr.wr.rdma.rkey = sd->stag;
+    st->read_wr.wr.rdma.remote_addr = sd->offset;
+    // Fill the client's region with incrementing values.
+    if (perftest_ctx->is_client) {
+        for (int i = 0; i < perftest_ctx->buf_size; i++) {
+            perftest_ctx->buf[i] = (char) i;
+        }
+        return 0;
+    }
+    // The server's issuer runs for the whole test, so thread creation is
+    // not timed.
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->cond, NULL);
+    if (pthread_create(&st->issuer, NULL, read_load_issue, st)) {
+        lwlog_err("Failed to start the issuing thread!");
+        // run_size only tears down the streams before this one.
+        pthread_mutex_destroy(&st->lock);
+        pthread_cond_destroy(&st->cond);
+        free(st->sched);
+        free(st);
+        perftest_ctx->priv = NULL;
+        return -1;
+    }
+    st->started = true;
+    return 0;
+}
+
+int read_load_iter(perftest_context *perftest_ctx) {
+    // Client does nothing.
+    if (perftest_ctx->is_client) {
+        return 0;
+    }
+    // Server issues reads to client, on a schedule fixed by the issuer.
+    struct read_load_state *st = (struct read_load_state*) perftest_ctx->priv;
+    __atomic_store_n(&st->ret, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&st->lock);
+    st->gen++;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+    int ret;
+    int reaped = 0;
+    struct work_completion wc;
+    auto read_cq = perftest_ctx->ctx->send_q->cq->q;
+    while (reaped < perftest_ctx->max_reqs) {
+        ret = read_cq->try_dequeue(wc);
+        if (!ret) {
+            // Reads the issuer never posted will not complete.
+            if (unlikely(__atomic_load_n(&st->ret, __ATOMIC_RELAXED))) {
+                break;
+            }
+            continue;
+        }
+        perftest_record_op(perftest_ctx, st->sched[wc.wr_id]);
+        reaped++;
+        if (wc.status != WC_SUCCESS) {
+            lwlog_err("Received remote send with error");
+            __atomic_store_n(&st->ret, -1, __ATOMIC_RELAXED);
+        } else if (wc.opcode != WC_READ_REQUEST) {
+            lwlog_err("Received wrong message type!");
+            __atomic_store_n(&st->ret, -1, __ATOMIC_RELAXED);
+        }
+    }
+    // The issuer is done with this iteration before the next one starts.
+    pthread_mutex_lock(&st->lock);
+    while (st->done != st->gen) {
+        pthread_cond_wait(&st->cond, &st->lock);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return __atomic_load_n(&st->ret, __ATOMIC_RELAXED);
+}
+
+void read_load_fini(perftest_context *perftest_ctx, float time_s) {
+    struct read_load_state *st = (struct read_load_state*) perftest_ctx->priv;
+    if (st && st->started) {
+        pthread_mutex_lock(&st->lock);
+        st->stop = true;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+        pthread_join(st->issuer, NULL);
+        pthread_mutex_destroy(&st->lock);
+        pthread_cond_destroy(&st->cond);
+    }
+    if (st) {
+        free(st->sched);
+        free(st);
+    }
+}
+
+int main(int argc, char **argv) {
+    perftest_run(argc, argv, read_load_init, read_load_iter, read_load_fini);
+}
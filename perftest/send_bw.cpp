@@ -0,0 +1,207 @@
+/*
+ * Software Userspace iWARP device driver for Linux 
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2021 Saksham Goel, Matthew Pabst
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "perftest.h"
+#include "rdmap/rdmap.h"
+
+struct send_bw_state {
+    struct sge send_sg;
+    struct send_wr send_wr;
+    struct sge recv_sg;
+    struct recv_wr recv_wr;
+    uint64_t rnr_start;
+    //! Bidirectional only: the data we send, apart from the receive buffer
+    char *src;
+};
+
+int send_bw_init(perftest_context *perftest_ctx, uint32_t lstag, struct send_data *sd) {
+    struct send_bw_state *st = (struct send_bw_state*) calloc(1, sizeof(*st));
+    if (!st) {
+        return -1;
+    }
+    perftest_ctx->priv = st;
+    perftest_ctx->msgs_per_iter = perftest_ctx->max_reqs;
+    char *src = perftest_ctx->buf;
+    if (perftest_ctx->bidir) {
+        perftest_ctx->msgs_per_iter = 2 * perftest_ctx->max_reqs;
+        st->src = (char*) malloc(perftest_ctx->buf_size);
+        if (!st->src) {
+            return -1;
+        }
+        src = st->src;
+    }
+    // Build send WR.
+    st->send_sg.addr = (uint64_t) src;
+    st->send_sg.length = perftest_ctx->buf_size;
+    st->send_sg.lkey = lstag;
+    st->send_wr.wr_id = 2;
+    st->send_wr.sg_list = &st->send_sg;
+    st->send_wr.num_sge = 1;
+    st->send_wr.opcode = RDMAP_SEND;
+    // Build recv WR, every receive lands in the same buffer, sized for
+    // the largest message so receives left from a smaller size still fit.
+    st->recv_sg.addr = (uint64_t) perftest_ctx->buf;
+    st->recv_sg.length = perftest_ctx->buf_max;
+    st->recv_sg.lkey = lstag;
+    st->recv_wr.wr_id = 3;
+    st->recv_wr.sg_list = &st->recv_sg;
+    st->recv_wr.num_sge = 1;
+    if (perftest_ctx->is_client || perftest_ctx->bidir) {
+        // Fill the buffer with incrementing values.
+        for (int i = 0; i < perftest_ctx->buf_size; i++) {
+            src[i] = (char) i;
+        }
+    }
+    if (!perftest_ctx->is_client || perftest_ctx->bidir) {
+        // Keep the RQ pre-posted at depth, one receive per in-flight send.
+        for (; perftest_ctx->recvs_posted < perftest_ctx->max_reqs; perftest_ctx->recvs_posted++) {
+            if (rdma_post_recv(perftest_ctx->ctx, st->recv_wr) < 0) {
+                lwlog_err("Failed to post receive!");
+                return -1;
+            }
+        }
+    }
+    st->rnr_start = __atomic_load_n(&perftest_ctx->ctx->ddp_ctx->rnr_drops, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Both sides send a batch while taking the peer's. Sends and receives
+ * complete on the same CQ, and each direction is timed on its own.
+ *  returns: 0 on success, -1 on failure.
+ */
+static int send_bw_bidir_iter(perftest_context *perftest_ctx) {
+    struct send_bw_state *st = (struct send_bw_state*) perftest_ctx->priv;
+    uint64_t start_ns = get_nanos();
+    for (int i = 0; i < perftest_ctx->max_reqs; i++) {
+        if (rdmap_send(perftest_ctx->ctx, st->send_wr) < 0) {
+            lwlog_err("Failed to issue Send!");
+            return -1;
+        }
+    }
+    struct work_completion wc;
+    auto cqq = perftest_ctx->ctx->send_q->cq->q;
+    int sends = 0, recvs = 0;
+    bool rx_done = false;
+    // Dropped messages count as received, or we would hang.
+    uint64_t *rnr = &perftest_ctx->ctx->ddp_ctx->rnr_drops;
+    uint64_t rnr_before = __atomic_load_n(rnr, __ATOMIC_RELAXED);
+    while (sends < perftest_ctx->max_reqs || !rx_done) {
+        if (!rx_done && recvs + (int) (__atomic_load_n(rnr, __ATOMIC_RELAXED) - rnr_before) >= perftest_ctx->max_reqs) {
+            rx_done = true;
+            perftest_ctx->rx_ns += get_nanos() - start_ns;
+        }
+        if (!cqq->try_dequeue(wc)) {
+            continue;
+        }
+        if (wc.status != WC_SUCCESS) {
+            lwlog_err("Received completion with error");
+            return -1;
+        } else if (wc.opcode == WC_SEND) {
+            if (++sends == perftest_ctx->max_reqs) {
+                perftest_ctx->tx_ns += get_nanos() - start_ns;
+            }
+        } else if (wc.opcode == WC_RECV) {
+            recvs++;
+            if (rdma_post_recv(perftest_ctx->ctx, st->recv_wr) < 0) {
+                lwlog_err("Failed to repost receive!");
+                return -1;
+            }
+        } else {
+            lwlog_err("Received wrong message type!");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int send_bw_iter(perftest_context *perftest_ctx) {
+    struct send_bw_state *st = (struct send_bw_state*) perftest_ctx->priv;
+    struct work_completion wc;
+    auto cqq = perftest_ctx->ctx->send_q->cq->q;
+    int ret;
+    if (perftest_ctx->bidir) {
+        return send_bw_bidir_iter(perftest_ctx);
+    }
+    if (perftest_ctx->is_client) {
+        // Send the buffer to the remote.
+        lwlog_debug("issuing sends ...");
+        for (int i = 0; i < perftest_ctx->max_reqs; i++) {
+            ret = rdmap_send(perftest_ctx->ctx, st->send_wr);
+            if (ret < 0) {
+                lwlog_err("Failed to issue Send!");
+                return -1;
+            }
+        }
+        for (int i = 0; i < perftest_ctx->max_reqs; i++) {
+            do { ret = cqq->try_dequeue(wc); } while (!ret) ;
+            if (wc.status != WC_SUCCESS) {
+                lwlog_err("Received send completion with error");
+                return -1;
+            } else if (wc.opcode != WC_SEND) {
+                lwlog_err("Received wrong message type!");
+                return -1;
+            }
+        }
+        return 0;
+    }
+    // Server takes max_reqs messages, dropped ones count too or we would hang.
+    int recvs = 0;
+    uint64_t *rnr = &perftest_ctx->ctx->ddp_ctx->rnr_drops;
+    uint64_t rnr_before = __atomic_load_n(rnr, __ATOMIC_RELAXED);
+    while (recvs + (int) (__atomic_load_n(rnr, __ATOMIC_RELAXED) - rnr_before) < perftest_ctx->max_reqs) {
+        if (!cqq->try_dequeue(wc)) {
+            continue;
+        }
+        if (wc.status != WC_SUCCESS) {
+            lwlog_err("Received recv completion with error");
+            return -1;
+        } else if (wc.opcode != WC_RECV) {
+            lwlog_err("Received wrong message type!");
+            return -1;
+        }
+        recvs++;
+        if (rdma_post_recv(perftest_ctx->ctx, st->recv_wr) < 0) {
+            lwlog_err("Failed to repost receive!");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void send_bw_fini(perftest_context *perftest_ctx, float time_s) {
+    struct send_bw_state *st = (struct send_bw_state*) perftest_ctx->priv;
+    if (!perftest_ctx->is_client || perftest_ctx->bidir) {
+        uint64_t rnr = __atomic_load_n(&perftest_ctx->ctx->ddp_ctx->rnr_drops, __ATOMIC_RELAXED);
+        lwlog_notice("Receiver-not-ready drops: %lu", rnr - st->rnr_start);
+    }
+    free(st->src);
+    free(st);
+}
+
+int main(int argc, char **argv) {
+    perftest_run(argc, argv, send_bw_init, send_bw_iter, send_bw_fini);
+}
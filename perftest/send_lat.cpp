@@ -0,0 +1,138 @@
+/*
+ * Software Userspace iWARP device driver for Linux 
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2021 Saksham Goel, Matthew Pabst
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "perftest.h"
+#include "rdmap/rdmap.h"
+
+struct send_lat_state {
+    struct sge send_sg;
+    struct send_wr send_wr;
+    struct sge recv_sg;
+    struct recv_wr recv_wr;
+    uint64_t rnr_start;
+};
+
+/*
+ * Polls the stream's CQ, shared by sends and receives, until `sends` send
+ * and `recvs` receive completions came in. Every receive is reposted at
+ * once so the RQ stays at depth.
+ */
+static int send_lat_poll(perftest_context *perftest_ctx, struct send_lat_state *st, int sends, int recvs) {
+    struct work_completion wc;
+    auto cqq = perftest_ctx->ctx->send_q->cq->q;
+    while (sends > 0 || recvs > 0) {
+        if (!cqq->try_dequeue(wc)) {
+            continue;
+        }
+        if (wc.status != WC_SUCCESS) {
+            lwlog_err("Received completion with error");
+            return -1;
+        }
+        if (wc.opcode == WC_SEND) {
+            sends--;
+        } else if (wc.opcode == WC_RECV) {
+            recvs--;
+            if (rdma_post_recv(perftest_ctx->ctx, st->recv_wr) < 0) {
+                lwlog_err("Failed to repost receive!");
+                return -1;
+            }
+        } else {
+            lwlog_err("Received wrong message type!");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int send_lat_init(perftest_context *perftest_ctx, uint32_t lstag, struct send_data *sd) {
+    struct send_lat_state *st = (struct send_lat_state*) calloc(1, sizeof(*st));
+    if (!st) {
+        return -1;
+    }
+    perftest_ctx->priv = st;
+    // Build send WR.
+    st->send_sg.addr = (uint64_t) perftest_ctx->buf;
+    st->send_sg.length = perftest_ctx->buf_size;
+    st->send_sg.lkey = lstag;
+    st->send_wr.wr_id = 2;
+    st->send_wr.sg_list = &st->send_sg;
+    st->send_wr.num_sge = 1;
+    st->send_wr.opcode = RDMAP_SEND;
+    // Build recv WR, every receive lands in the same buffer, sized for
+    // the largest message so receives left from a smaller size still fit.
+    st->recv_sg.addr = (uint64_t) perftest_ctx->buf;
+    st->recv_sg.length = perftest_ctx->buf_max;
+    st->recv_sg.lkey = lstag;
+    st->recv_wr.wr_id = 3;
+    st->recv_wr.sg_list = &st->recv_sg;
+    st->recv_wr.num_sge = 1;
+    // Keep the RQ pre-posted at depth.
+    for (; perftest_ctx->recvs_posted < perftest_ctx->max_reqs; perftest_ctx->recvs_posted++) {
+        if (rdma_post_recv(perftest_ctx->ctx, st->recv_wr) < 0) {
+            lwlog_err("Failed to post receive!");
+            return -1;
+        }
+    }
+    st->rnr_start = __atomic_load_n(&perftest_ctx->ctx->ddp_ctx->rnr_drops, __ATOMIC_RELAXED);
+    // The server starts each ping-pong, so it times the round trips.
+    perftest_ctx->records_ops = true;
+    return 0;
+}
+
+int send_lat_iter(perftest_context *perftest_ctx) {
+    struct send_lat_state *st = (struct send_lat_state*) perftest_ctx->priv;
+    uint64_t start_ns = get_nanos();
+    if (perftest_ctx->is_client) {
+        // Wait for the ping, then answer it.
+        if (send_lat_poll(perftest_ctx, st, 0, 1)) {
+            return -1;
+        }
+    }
+    if (rdmap_send(perftest_ctx->ctx, st->send_wr) < 0) {
+        lwlog_err("Failed to issue Send!");
+        return -1;
+    }
+    if (perftest_ctx->is_client) {
+        return send_lat_poll(perftest_ctx, st, 1, 0);
+    }
+    if (send_lat_poll(perftest_ctx, st, 1, 1)) {
+        return -1;
+    }
+    // Half a round trip is one send landing at the far end.
+    perftest_hist_record(perftest_ctx->lat, (get_nanos() - start_ns) / 2);
+    return 0;
+}
+
+void send_lat_fini(perftest_context *perftest_ctx, float time_s) {
+    struct send_lat_state *st = (struct send_lat_state*) perftest_ctx->priv;
+    uint64_t rnr = __atomic_load_n(&perftest_ctx->ctx->ddp_ctx->rnr_drops, __ATOMIC_RELAXED);
+    lwlog_notice("Receiver-not-ready drops: %lu", rnr - st->rnr_start);
+    free(st);
+}
+
+int main(int argc, char **argv) {
+    perftest_run(argc, argv, send_lat_init, send_lat_iter, send_lat_fini);
+}
@@ -0,0 +1,98 @@
+/*
+ * Software Userspace iWARP device driver for Linux 
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2021 Saksham Goel, Matthew Pabst
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PERFTEST_VERIFY_H
+#define PERFTEST_VERIFY_H
+
+#include <stdint.h>
+#include <emmintrin.h>
+
+/*
+ * Data patterns for --verify. Byte i of the pattern for sequence number
+ * `seq` is (i + seq) mod 256, so every iteration's data differs from the
+ * last one's. Filling and checking go 16 bytes at a time with SSE2, and
+ * both run outside the timed region.
+ */
+
+static inline __m128i perftest_pattern_first(uint64_t seq) {
+    return _mm_add_epi8(_mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                        _mm_set1_epi8((char) seq));
+}
+
+static inline void perftest_pattern_fill(char *buf, int len, uint64_t seq) {
+    const __m128i step = _mm_set1_epi8(16);
+    __m128i v = perftest_pattern_first(seq);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        _mm_storeu_si128((__m128i*) (buf + i), v);
+        v = _mm_add_epi8(v, step);
+    }
+    for (; i < len; i++) {
+        buf[i] = (char) (i + seq);
+    }
+}
+
+//! Fills buf so that no byte matches seq's pattern, for the receiving side
+static inline void perftest_pattern_poison(char *buf, int len, uint64_t seq) {
+    perftest_pattern_fill(buf, len, seq + 128);
+}
+
+/*
+ * Compares buf against seq's pattern.
+ *  returns: the offset of the first wrong byte, -1 if all of them match.
+ */
+static inline int perftest_pattern_check(const char *buf, int len, uint64_t seq) {
+    const __m128i step = _mm_set1_epi8(16);
+    __m128i v = perftest_pattern_first(seq);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i got = _mm_loadu_si128((const __m128i*) (buf + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(got, v)) != 0xffff) {
+            break;
+        }
+        v = _mm_add_epi8(v, step);
+    }
+    // The tail, or the chunk that failed, byte by byte.
+    for (; i < len; i++) {
+        if (buf[i] != (char) (i + seq)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+struct perftest_context;
+
+/*
+ * --verify hooks shared by the RDMA Read tests: the client stamps the
+ * region the server reads, and the server poisons its own copy so a read
+ * that never landed cannot pass. Defined in perftest.cpp.
+ */
+void perftest_verify_read_stamp(struct perftest_context *c, uint64_t seq);
+//! Checks the server's copy once the reads are done, 0 if it matches
+int perftest_verify_read_check(struct perftest_context *c, uint64_t seq);
+
+#endif // PERFTEST_VERIFY_H
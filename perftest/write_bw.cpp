@@ -29,63 +29,153 @@
 
 #include <x86intrin.h>
 
-struct sge write_sg;
-struct send_wr write_wr;
-
 uint32_t byte_end = 0xdeadbeef;
-struct sge write_sg_end;
-struct send_wr write_wr_end;
+
+struct write_bw_state {
+    struct sge write_sg;
+    struct send_wr write_wr;
+    struct sge write_sg_end;
+    struct send_wr write_wr_end;
+    //! Bidirectional only: the data we write, so the peer's writes into buf
+    //! (end marker included) never end up in ours
+    char *src;
+};
 
 int write_bw_init(perftest_context *perftest_ctx, uint32_t lstag, struct send_data *sd) {
+    struct write_bw_state *st = (struct write_bw_state*) calloc(1, sizeof(*st));
+    if (!st) {
+        return -1;
+    }
+    perftest_ctx->priv = st;
+    perftest_ctx->msgs_per_iter = perftest_ctx->max_reqs;
+    char *src = perftest_ctx->buf;
+    if (perftest_ctx->bidir) {
+        perftest_ctx->msgs_per_iter = 2 * perftest_ctx->max_reqs;
+        st->src = (char*) malloc(perftest_ctx->buf_size);
+        if (!st->src) {
+            return -1;
+        }
+        src = st->src;
+    }
     // Build write WR.
-    write_sg.addr = (uint64_t) perftest_ctx->buf;
-    write_sg.length = perftest_ctx->buf_size;
-    write_sg.lkey = lstag;
-    write_wr.wr_id = 2;
-    write_wr.sg_list = &write_sg;
-    write_wr.num_sge = 1;
-    write_wr.opcode = RDMAP_RDMA_WRITE;
-    write_wr.wr.rdma.rkey = sd->stag;
-    write_wr.wr.rdma.remote_addr = sd->offset;
+    st->write_sg.addr = (uint64_t) src;
+    st->write_sg.length = perftest_ctx->buf_size;
+    st->write_sg.lkey = lstag;
+    st->write_wr.wr_id = 2;
+    st->write_wr.sg_list = &st->write_sg;
+    st->write_wr.num_sge = 1;
+    st->write_wr.opcode = RDMAP_RDMA_WRITE;
+    st->write_wr.wr.rdma.rkey = sd->stag;
+    st->write_wr.wr.rdma.remote_addr = sd->offset;
     // Build ending write WR.
-    write_sg_end.addr = (uint64_t) &byte_end;
-    write_sg_end.length = 4;
-    write_sg_end.lkey = 0;
-    write_wr_end.wr_id = 0xffffffff;
-    write_wr_end.sg_list = &write_sg_end;
-    write_wr_end.num_sge = 1;
-    write_wr_end.opcode = RDMAP_RDMA_WRITE;
-    write_wr_end.wr.rdma.rkey = sd->stag;
-    write_wr_end.wr.rdma.remote_addr = sd->offset;
-    if (perftest_ctx->is_client) {
+    st->write_sg_end.addr = (uint64_t) &byte_end;
+    st->write_sg_end.length = perftest_ctx->buf_size < 4 ? perftest_ctx->buf_size : 4;
+    st->write_sg_end.lkey = 0;
+    st->write_wr_end.wr_id = 0xffffffff;
+    st->write_wr_end.sg_list = &st->write_sg_end;
+    st->write_wr_end.num_sge = 1;
+    st->write_wr_end.opcode = RDMAP_RDMA_WRITE;
+    st->write_wr_end.wr.rdma.rkey = sd->stag;
+    st->write_wr_end.wr.rdma.remote_addr = sd->offset;
+    // The first byte stays 0 until the end marker lands.
+    if (perftest_ctx->is_client || perftest_ctx->bidir) {
         // Fill the buffer with incrementing values.
         for (int i = 0; i < perftest_ctx->buf_size; i++) {
-            perftest_ctx->buf[i] = (char) i;
+            src[i] = (char) i;
         }
-    } else {
+    }
+    if (!perftest_ctx->is_client || perftest_ctx->bidir) {
         memset(perftest_ctx->buf, 0, perftest_ctx->buf_size);
     }
     return 0;
 }
 
+static int write_bw_check(struct work_completion *wc) {
+    if (wc->status != WC_SUCCESS) {
+        lwlog_err("Received remote send with error");
+        return -1;
+    } else if (wc->opcode != WC_WRITE) {
+        lwlog_err("Received wrong message type!");
+        return -1;
+    }
+    return 0;
+}
+
+//! Whether the peer's end marker has landed, clears it if so
+static bool write_bw_end_arrived(perftest_context *perftest_ctx) {
+    _mm_clflush(&perftest_ctx->buf[0]);
+    _mm_sfence();
+    if (perftest_ctx->buf[0] == 0) {
+        return false;
+    }
+    lwlog_debug("found write with value %hhx!", perftest_ctx->buf[0]);
+    // Only clear a byte if we're benchmarking.
+    ((uint32_t*)perftest_ctx->buf)[0] = 0;
+    return true;
+}
+
+static int write_bw_post(perftest_context *perftest_ctx, struct send_wr &wr) {
+    if (rdmap_write(perftest_ctx->ctx, wr) < 0) {
+        lwlog_err("Failed to issue RDMA Write!");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Both sides write their batch and the end marker while watching for the
+ * peer's, timing each direction separately.
+ *  returns: 0 on success, -1 on failure.
+ */
+static int write_bw_bidir_iter(perftest_context *perftest_ctx) {
+    struct write_bw_state *st = (struct write_bw_state*) perftest_ctx->priv;
+    uint64_t start_ns = get_nanos();
+    for (int i = 0; i < perftest_ctx->max_reqs; i++) {
+        if (write_bw_post(perftest_ctx, st->write_wr)) {
+            return -1;
+        }
+    }
+    struct work_completion wc;
+    auto write_cq = perftest_ctx->ctx->send_q->cq->q;
+    int completed = 0;
+    bool tx_done = false, rx_done = false;
+    while (!tx_done || !rx_done) {
+        if (!tx_done && write_cq->try_dequeue(wc)) {
+            if (write_bw_check(&wc)) {
+                return -1;
+            }
+            // The end marker goes out once the batch has, its completion ends our side.
+            if (++completed == perftest_ctx->max_reqs) {
+                if (write_bw_post(perftest_ctx, st->write_wr_end)) {
+                    return -1;
+                }
+            } else if (completed > perftest_ctx->max_reqs) {
+                tx_done = true;
+                perftest_ctx->tx_ns += get_nanos() - start_ns;
+            }
+        }
+        if (!rx_done && write_bw_end_arrived(perftest_ctx)) {
+            rx_done = true;
+            perftest_ctx->rx_ns += get_nanos() - start_ns;
+        }
+    }
+    return 0;
+}
+
 int write_bw_iter(perftest_context *perftest_ctx) {
+    struct write_bw_state *st = (struct write_bw_state*) perftest_ctx->priv;
     int ret;
+    if (perftest_ctx->bidir) {
+        return write_bw_bidir_iter(perftest_ctx);
+    }
     if (!perftest_ctx->is_client) {
         lwlog_debug("waiting for write ...");
-        do { 
-            _mm_clflush(&perftest_ctx->buf[0]); 
-            _mm_sfence();
-        } while (perftest_ctx->buf[0] == 0) ;
-        lwlog_debug("found write with value %hhx!", perftest_ctx->buf[0]);
-        // Only clear a byte if we're benchmarking.
-        ((uint32_t*)perftest_ctx->buf)[0] = 0;
+        while (!write_bw_end_arrived(perftest_ctx)) ;
     } else {
         // Write the buffer to the remote.
         lwlog_debug("issuing writes ...");
         for (int i = 0; i < perftest_ctx->max_reqs; i++) {
-            ret = rdmap_write(perftest_ctx->ctx, write_wr);
-            if (ret < 0) {
-                lwlog_err("Failed to issue RDMA Write!");
+            if (write_bw_post(perftest_ctx, st->write_wr)) {
                 return -1;
             }
         }
@@ -95,22 +185,16 @@ int write_bw_iter(perftest_context *perftest_ctx) {
         for (int i = 0; i < perftest_ctx->max_reqs; i++) {
             do { ret = write_cq->try_dequeue(wc); } while (!ret) ;
             lwlog_debug("received completion");
-            if (wc.status != WC_SUCCESS) {
-                lwlog_err("Received remote send with error");
-                return -1;
-            } else if (wc.opcode != WC_WRITE) {
-                lwlog_err("Received wrong message type!");
+            if (write_bw_check(&wc)) {
                 return -1;
             }
         }
         // Issue the last write that indicates completion.
-        ret = rdmap_write(perftest_ctx->ctx, write_wr_end);
-        do { ret = write_cq->try_dequeue(wc); } while (!ret) ;
-        if (wc.status != WC_SUCCESS) {
-            lwlog_err("Received remote send with error");
+        if (write_bw_post(perftest_ctx, st->write_wr_end)) {
             return -1;
-        } else if (wc.opcode != WC_WRITE) {
-            lwlog_err("Received wrong message type!");
+        }
+        do { ret = write_cq->try_dequeue(wc); } while (!ret) ;
+        if (write_bw_check(&wc)) {
             return -1;
         }
     }
@@ -118,11 +202,11 @@ int write_bw_iter(perftest_context *perftest_ctx) {
 }
 
 void write_bw_fini(perftest_context *perftest_ctx, float time_s) {
-    uint64_t num_requests = perftest_ctx->max_reqs * perftest_ctx->iters;
-    float Mpps = num_requests / (time_s * 1000.0 * 1000.0);
-    float MBps = (num_requests * perftest_ctx->buf_size) / (time_s * 1000.0 * 1000.0);
-    lwlog_notice("Message rate (Mp/s): %f", Mpps);
-    lwlog_notice("Bandwidth (MB/s): %f", MBps);
+    struct write_bw_state *st = (struct write_bw_state*) perftest_ctx->priv;
+    if (st) {
+        free(st->src);
+        free(st);
+    }
 }
 
 int main(int argc, char **argv) {
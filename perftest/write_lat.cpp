@@ -29,20 +29,31 @@
 
 #include <x86intrin.h>
 
-struct sge write_sg;
-struct send_wr write_wr;
+struct write_lat_state {
+    struct sge write_sg;
+    struct send_wr write_wr;
+};
 
 int write_lat_init(perftest_context *perftest_ctx, uint32_t lstag, struct send_data *sd) {
+    // The ping-pong flag lives in buf[1].
+    if (perftest_ctx->buf_size < 2) {
+        return PERFTEST_SKIP;
+    }
+    struct write_lat_state *st = (struct write_lat_state*) calloc(1, sizeof(*st));
+    if (!st) {
+        return -1;
+    }
+    perftest_ctx->priv = st;
     // Build write WR.
-    write_sg.addr = (uint64_t) perftest_ctx->buf;
-    write_sg.length = perftest_ctx->buf_size;
-    write_sg.lkey = lstag;
-    write_wr.wr_id = 2;
-    write_wr.sg_list = &write_sg;
-    write_wr.num_sge = 1;
-    write_wr.opcode = RDMAP_RDMA_WRITE;
-    write_wr.wr.rdma.rkey = sd->stag;
-    write_wr.wr.rdma.remote_addr = sd->offset;
+    st->write_sg.addr = (uint64_t) perftest_ctx->buf;
+    st->write_sg.length = perftest_ctx->buf_size;
+    st->write_sg.lkey = lstag;
+    st->write_wr.wr_id = 2;
+    st->write_wr.sg_list = &st->write_sg;
+    st->write_wr.num_sge = 1;
+    st->write_wr.opcode = RDMAP_RDMA_WRITE;
+    st->write_wr.wr.rdma.rkey = sd->stag;
+    st->write_wr.wr.rdma.remote_addr = sd->offset;
     if (!perftest_ctx->is_client) {
         // Fill the client's region with incrementing values.
         for (int i = 0; i < perftest_ctx->buf_size; i++) {
@@ -51,13 +62,17 @@ int write_lat_init(perftest_context *perftest_ctx, uint32_t lstag, struct send_d
     } else {
         memset(perftest_ctx->buf, 0, perftest_ctx->buf_size);
     }
+    // The server starts each ping-pong, so it times the round trips.
+    perftest_ctx->records_ops = true;
     return 0;
 }
 
 int write_lat_iter(perftest_context *perftest_ctx) {
+    struct write_lat_state *st = (struct write_lat_state*) perftest_ctx->priv;
     int ret;
     //  Server waits to receive write.
     bool role = perftest_ctx->is_client;
+    uint64_t start_ns = get_nanos();
     do {
         if (role) {
             lwlog_debug("waiting for write ...");
@@ -76,7 +91,7 @@ int write_lat_iter(perftest_context *perftest_ctx) {
         } else {
             // Write the buffer to the remote.
             lwlog_debug("issuing write ...");
-            ret = rdmap_write(perftest_ctx->ctx, write_wr);
+            ret = rdmap_write(perftest_ctx->ctx, st->write_wr);
             if (ret < 0) {
                 lwlog_err("Failed to issue RDMA Write!");
                 return -1;
@@ -96,10 +111,16 @@ int write_lat_iter(perftest_context *perftest_ctx) {
         }
         role = !role;
     } while (role != perftest_ctx->is_client);
+    if (!perftest_ctx->is_client) {
+        // Half a round trip is one write landing at the far end.
+        perftest_hist_record(perftest_ctx->lat, (get_nanos() - start_ns) / 2);
+    }
     return 0;
 }
 
-void write_lat_fini(perftest_context *ctx, float time_s) {}
+void write_lat_fini(perftest_context *ctx, float time_s) {
+    free(ctx->priv);
+}
 
 int main(int argc, char **argv) {
     perftest_run(argc, argv, write_lat_init, write_lat_iter, write_lat_fini);
@@ -45,6 +45,7 @@ struct ddp_stream_context* ddp_init_stream(int sockfd, struct pd_t* pd)
 void ddp_kill_stream(struct ddp_stream_context* ctx) 
 {
     delete[] ctx->queues;
+    free(ctx->discard);
     delete ctx;
 
     return;
@@ -102,6 +103,18 @@ int ddp_send_tagged(struct ddp_stream_context* ctx, struct ddp_tagged_meta* next
         }
     }
 
+    //! Zero-length message: a lone header segment still has to go out
+    if (unlikely(!(hdr.bits & DDP_FLAG_LAST)))
+    {
+        hdr.bits |= DDP_FLAG_LAST;
+        int ret = mpa_send(ctx->sockfd, mpa_sge_list, sg_num, 0);
+        if (unlikely(ret < 0))
+        {
+            lwlog_err("send failed: %d", ret);
+            return ret;
+        }
+    }
+
     return 0;
 }
 
@@ -155,6 +168,18 @@ int ddp_send_untagged(struct ddp_stream_context* ctx, struct ddp_untagged_meta*
         }
     }
 
+    //! Zero-length message: a lone header segment still has to go out
+    if (unlikely(!(hdr.bits & DDP_FLAG_LAST)))
+    {
+        hdr.bits |= DDP_FLAG_LAST;
+        int ret = mpa_send(ctx->sockfd, mpa_sge_list, sg_num, 0);
+        if (unlikely(ret < 0))
+        {
+            lwlog_err("send failed: %d", ret);
+            return ret;
+        }
+    }
+
     return 0;
 }
 
@@ -319,6 +344,14 @@ int ddp_recv(struct ddp_stream_context* ctx, struct ddp_message* msg)
         if (unlikely(!found))
         {
             lwlog_err("untagged buffer queue is empty");
+            __atomic_fetch_add(&ctx->rnr_drops, 1, __ATOMIC_RELAXED);
+            if (!ctx->discard)
+            {
+                ctx->discard = (char*) malloc(ULPDU_MAX_SIZE);
+                if (!ctx->discard) return -ENOMEM;
+            }
+            msg->untag_buf.data = NULL;
+            msg->untag_buf.len = 0;
         }
 
         struct ddp_hdr_packed packed_hdr;
@@ -328,7 +361,15 @@ int ddp_recv(struct ddp_stream_context* ctx, struct ddp_message* msg)
         while(true)
         {
             //! Copy current payload to the right path
-            mpa_packet.ulpdu = (char *) ((uint64_t)msg->untag_buf.data + packed_hdr.untagged_metadata.mo);
+            if (unlikely(found && (uint64_t)packed_hdr.untagged_metadata.mo + mpa_payload_len > msg->untag_buf.len))
+            {
+                lwlog_err("untagged message overflows the posted %u byte buffer", msg->untag_buf.len);
+                return -1;
+            }
+            if (likely(found))
+                mpa_packet.ulpdu = (char *) ((uint64_t)msg->untag_buf.data + packed_hdr.untagged_metadata.mo);
+            else
+                mpa_packet.ulpdu = ctx->discard;
             ret = mpa_recv(ctx->sockfd, &mpa_packet, mpa_payload_len);
             ddp_payload_len += mpa_payload_len;
             if (unlikely(ret < 0)) return -1;
@@ -368,22 +409,3 @@ int deregister_tagged_buffer(struct ddp_stream_context* ctx, struct stag_t* stag
     int ret = ctx->tagged_buffers.erase(stag->tag);
     return ret;
 }
-
-//! C++ function, bad
-struct tagged_buffer* ddp_check_stag(struct ddp_stream_context* ctx, struct ddp_tagged_meta* hdr)
-{
-    auto it = ctx->tagged_buffers.find(hdr->tag);
-    if (unlikely(it == ctx->tagged_buffers.end()))
-    {
-        lwlog_err("ddp recv found invalid tag");
-        return NULL;
-    }
-
-    if (unlikely((uint64_t)it->second.data > hdr->TO || (uint64_t)it->second.data + it->second.len < hdr->TO))
-    {
-        lwlog_err("invalid offset TO: %llu, data: %lu, len: %lu", hdr->TO, (uint64_t)it->second.data, it->second.len);
-        return NULL;
-    }
-    //! TODO: Do access control
-    return &it->second;
-}
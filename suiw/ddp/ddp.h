@@ -37,7 +37,7 @@
 //! C++ stdlib abomination
 #include <unordered_map>
 
-#define MAX_UNTAGGED_BUFFERS 3
+#define MAX_UNTAGGED_BUFFERS 5
 #define DDP_CTRL_SIZE 1
 #define DDP_TAGGED_HDR_SIZE sizeof(struct ddp_tagged_meta)
 #define DDP_UNTAGGED_HDR_SIZE sizeof(struct ddp_untagged_meta)
@@ -48,6 +48,11 @@ struct ddp_stream_context {
 
     struct untagged_buffer_queue* queues;
     std::unordered_map<__u32, tagged_buffer> tagged_buffers;
+
+    //! Untagged messages that found no buffer or receive posted (receiver not ready).
+    //! iWARP has no RNR retry, so these are read into `discard` and dropped.
+    uint64_t rnr_drops;
+    char* discard;
 };
 
 struct __attribute__((__packed__)) ddp_hdr {
@@ -163,6 +168,22 @@ int deregister_tagged_buffer(struct ddp_stream_context*, struct stag_t*);
  * @param hdr 
  * @return int 
  */
-inline struct tagged_buffer* ddp_check_stag(struct ddp_stream_context* ctx, struct ddp_tagged_meta* hdr);
+inline struct tagged_buffer* ddp_check_stag(struct ddp_stream_context* ctx, struct ddp_tagged_meta* hdr)
+{
+    auto it = ctx->tagged_buffers.find(hdr->tag);
+    if (unlikely(it == ctx->tagged_buffers.end()))
+    {
+        lwlog_err("ddp recv found invalid tag");
+        return NULL;
+    }
+
+    if (unlikely((uint64_t)it->second.data > hdr->TO || (uint64_t)it->second.data + it->second.len < hdr->TO))
+    {
+        lwlog_err("invalid offset TO: %llu, data: %lu, len: %lu", hdr->TO, (uint64_t)it->second.data, it->second.len);
+        return NULL;
+    }
+    //! TODO: Do access control
+    return &it->second;
+}
 
 #endif
\ No newline at end of file
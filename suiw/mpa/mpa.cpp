@@ -31,6 +31,7 @@
 #include <string.h>
 
 #include <netdb.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -39,20 +40,38 @@
 
 #include "lwlog.h"
 
-char log_buf[1024];
 int mpa_protocol_version = 1;
 
-int mpa_send_rr(int sockfd, const void* pdata, __u8 pd_len, int req)
+//! Logs a req/rep header; formatting it is skipped unless INFO is on
+static void mpa_log_rr(const char* what, const struct mpa_rr* hdr)
 {
-    //! Make MPA request header
-    struct mpa_rr hdr;
-    memset(&hdr, 0, sizeof hdr);
+#if LOG_LEVEL >= INFO
+    char buf[1024];
+    print_mpa_rr(hdr, buf);
+    lwlog_info("%s Message:\n%s", what, buf);
+#endif
+}
 
-    strncpy((char*)hdr.key, req ? MPA_KEY_REQ : MPA_KEY_REP, MPA_RR_KEY_LEN);
+//! Fills in the header of an outgoing request/reply
+static void mpa_fill_rr(struct mpa_rr* hdr, __u8 pd_len, int req)
+{
+    memset(hdr, 0, sizeof *hdr);
+
+    strncpy((char*)hdr->key, req ? MPA_KEY_REQ : MPA_KEY_REP, MPA_RR_KEY_LEN);
     int version = MPA_REVISION_1;
-    __mpa_rr_set_revision(&hdr.params.bits, version);
+    __mpa_rr_set_revision(&hdr->params.bits, version);
+#ifndef RPING
+    hdr->params.bits |= MPA_RR_FLAG_SUIW_EXT;
+#endif
+
+    hdr->params.pd_len = __cpu_to_be16(pd_len);
+}
 
-    hdr.params.pd_len = __cpu_to_be16(pd_len);
+int mpa_send_rr(int sockfd, const void* pdata, __u8 pd_len, int req)
+{
+    //! Make MPA request header
+    struct mpa_rr hdr;
+    mpa_fill_rr(&hdr, pd_len, req);
     
     int mpa_len = 0;
     
@@ -78,8 +97,7 @@ int mpa_send_rr(int sockfd, const void* pdata, __u8 pd_len, int req)
     msg.msg_iov = iov;
     msg.msg_iovlen = iovec_num+1;
 
-    print_mpa_rr(&hdr, log_buf);
-    lwlog_info("Sending Message:\n%s", log_buf);
+    mpa_log_rr("Sending", &hdr);
 
     int ret = sendmsg(sockfd, &msg, 0);
 #ifdef USE_TAS
@@ -106,8 +124,7 @@ int mpa_recv_rr(int sockfd, struct siw_mpa_info* info)
         return -1;
     }
 
-    print_mpa_rr(hdr, log_buf);
-    lwlog_info("Received Message:\n%s", log_buf);
+    mpa_log_rr("Received", hdr);
 
     __u16 pd_len = __be16_to_cpu(hdr->params.pd_len);
 
@@ -177,38 +194,179 @@ int mpa_recv_rr(int sockfd, struct siw_mpa_info* info)
     return rcvd;
 }
 
+//! We always advertise the extensions, so they are on iff the peer did too
+static inline int mpa_rr_suiw_ext(const struct mpa_rr* peer)
+{
+#ifdef RPING
+    return 0;
+#else
+    return (peer->params.bits & MPA_RR_FLAG_SUIW_EXT) != 0;
+#endif
+}
+
+int mpa_handshake_suiw_ext(const struct mpa_handshake* hs)
+{
+    return mpa_rr_suiw_ext(&hs->peer);
+}
+
+static void mpa_handshake_queue_rr(struct mpa_handshake* hs, const void* pdata, __u8 pd_len, int req)
+{
+    mpa_fill_rr((struct mpa_rr*)hs->out, pd_len, req);
+    if (pd_len) memcpy(hs->out + sizeof(struct mpa_rr), pdata, pd_len);
+    hs->out_len = sizeof(struct mpa_rr) + pd_len;
+    hs->out_off = 0;
+    hs->state = MPA_HS_SEND_RR;
+}
+
+void mpa_handshake_init(struct mpa_handshake* hs, int sockfd, int is_client,
+                        const void* pdata, __u8 pd_len)
+{
+    hs->sockfd = sockfd;
+    hs->is_client = is_client;
+    hs->in_off = 0;
+    hs->revision = 0;
+    if (is_client)
+    {
+        mpa_handshake_queue_rr(hs, pdata, pd_len, 1);
+    }
+    else
+    {
+        hs->out_len = hs->out_off = 0;
+        hs->state = MPA_HS_RECV_HDR;
+    }
+}
+
+int mpa_handshake_reply(struct mpa_handshake* hs, const void* pdata, __u8 pd_len, int reject)
+{
+    if (hs->is_client || hs->state != MPA_HS_REQ_RCVD) return -EINVAL;
+    mpa_handshake_queue_rr(hs, pdata, pd_len, 0);
+    if (reject) ((struct mpa_rr*)hs->out)->params.bits |= MPA_RR_FLAG_REJECT;
+    return 0;
+}
+
+//! Reads into `buf` until `len` bytes are there; 1 when complete,
+//! 0 if the socket has nothing more for now, < 0 on error
+static int mpa_handshake_read(struct mpa_handshake* hs, char* buf, int len)
+{
+    while (hs->in_off < len)
+    {
+        int rcvd = recv(hs->sockfd, buf + hs->in_off, len - hs->in_off, MSG_DONTWAIT);
+        if (rcvd == 0) return -EPIPE;
+        if (rcvd < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -errno;
+        hs->in_off += rcvd;
+    }
+    hs->in_off = 0;
+    return 1;
+}
+
+int mpa_handshake_progress(struct mpa_handshake* hs)
+{
+    int ret;
+    for (;;)
+    {
+        switch (hs->state)
+        {
+            case MPA_HS_SEND_RR: {
+                while (hs->out_off < hs->out_len)
+                {
+                    int sent = send(hs->sockfd, hs->out + hs->out_off, hs->out_len - hs->out_off,
+                                    MSG_DONTWAIT | MSG_NOSIGNAL);
+                    if (sent < 0)
+                        return (errno == EAGAIN || errno == EWOULDBLOCK) ? hs->state : -errno;
+                    hs->out_off += sent;
+                }
+                //! The client waits for the reply, the server is done
+                hs->state = hs->is_client ? MPA_HS_RECV_HDR : MPA_HS_DONE;
+                break;
+            }
+            case MPA_HS_RECV_HDR: {
+                ret = mpa_handshake_read(hs, (char*)&hs->peer, sizeof(struct mpa_rr));
+                if (ret <= 0) return ret < 0 ? ret : hs->state;
+
+                mpa_log_rr("Received", &hs->peer);
+                if (strncmp(hs->is_client ? MPA_KEY_REP : MPA_KEY_REQ, (char*)hs->peer.key, MPA_RR_KEY_LEN))
+                {
+                    lwlog_err("mpa_handshake: bad req/rep key");
+                    return -EPROTO;
+                }
+                if (mpa_handshake_pd_len(hs) > MPA_MAX_PRIVDATA)
+                {
+                    lwlog_err("mpa_handshake: private data too long");
+                    return -EPROTO;
+                }
+                hs->state = MPA_HS_RECV_PDATA;
+                break;
+            }
+            case MPA_HS_RECV_PDATA: {
+                ret = mpa_handshake_read(hs, hs->pdata, mpa_handshake_pd_len(hs));
+                if (ret <= 0) return ret < 0 ? ret : hs->state;
+
+                hs->revision = __mpa_rr_revision(hs->peer.params.bits);
+                if (!hs->is_client)
+                    hs->state = MPA_HS_REQ_RCVD;
+                else if (hs->peer.params.bits & MPA_RR_FLAG_REJECT)
+                    hs->state = MPA_HS_REJECTED;
+                else
+                    hs->state = MPA_HS_DONE;
+                break;
+            }
+            default:
+                return hs->state;
+        }
+    }
+}
+
+/*
+ * Drives `hs` on a blocking socket until it reaches `until` or a final
+ * state, sleeping in poll() whenever the socket has nothing for us.
+ */
+static int mpa_handshake_wait(struct mpa_handshake* hs, int until)
+{
+    for (;;)
+    {
+        int ret = mpa_handshake_progress(hs);
+        if (ret < 0 || ret == until || ret == MPA_HS_DONE || ret == MPA_HS_REJECTED)
+            return ret;
+
+        struct pollfd pfd;
+        pfd.fd = hs->sockfd;
+        pfd.events = ret == MPA_HS_SEND_RR ? POLLOUT : POLLIN;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -errno;
+    }
+}
+
 //! TODO: Add config options to choose CRC, Markers, etc.
 int mpa_client_connect(int sockfd, void* pdata_send, __u8 pd_len, void* pdata_recv)
 {
-    int ret = mpa_send_rr(sockfd, pdata_send, pd_len, 1);
+    struct mpa_handshake hs;
+    mpa_handshake_init(&hs, sockfd, 1, pdata_send, pd_len);
+    int ret = mpa_handshake_wait(&hs, MPA_HS_DONE);
     if (ret < 0) return ret;
-    struct siw_mpa_info info;
-    memset(&info, 0, sizeof(siw_mpa_info));
-    info.pdata = (char*)pdata_recv;
-    
-    ret = mpa_recv_rr(sockfd, &info);
-    if (ret < 0)
+    if (ret == MPA_HS_REJECTED)
     {
-        return ret;
+        lwlog_err("mpa_client_connect: peer rejected the connection");
+        return -ECONNREFUSED;
     }
 
-    mpa_protocol_version = __mpa_rr_revision(info.hdr.params.bits);
-    return 0;
+    if (pdata_recv) memcpy(pdata_recv, hs.pdata, mpa_handshake_pd_len(&hs));
+    mpa_protocol_version = hs.revision;
+    return mpa_handshake_suiw_ext(&hs);
 }
 
 int mpa_server_accept(int sockfd, void *pdata_send, __u8 pd_len, void* pdata_recv)
 {
-    int ret;
-    struct siw_mpa_info info;
-    memset(&info, 0, sizeof(siw_mpa_info));
-    info.pdata = (char*)pdata_recv;
-    ret = mpa_recv_rr(sockfd, &info);
+    struct mpa_handshake hs;
+    mpa_handshake_init(&hs, sockfd, 0, NULL, 0);
+    int ret = mpa_handshake_wait(&hs, MPA_HS_REQ_RCVD);
     if (ret < 0) return ret;
-    mpa_protocol_version = __mpa_rr_revision(info.hdr.params.bits);
+    if (pdata_recv) memcpy(pdata_recv, hs.pdata, mpa_handshake_pd_len(&hs));
 
-    ret = mpa_send_rr(sockfd, pdata_send, pd_len, 0);
+    mpa_handshake_reply(&hs, pdata_send, pd_len, 0);
+    ret = mpa_handshake_wait(&hs, MPA_HS_DONE);
     if (ret < 0) return ret;
-    return 0;
+    mpa_protocol_version = hs.revision;
+    return mpa_handshake_suiw_ext(&hs);
 }
 
 int mpa_send(int sockfd, sge* sg_list, int num_sge, int flags)
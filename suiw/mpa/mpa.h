@@ -39,7 +39,12 @@
 #define ULPDU_MAX_SIZE 1 << 16
 #define FPDU_MAX_SIZE ULPDU_MAX_SIZE + 2 + MPA_CRC_SIZE
 
-//!
+//! Reserved req/rep bit advertising the SoftUiWarp RDMAP extensions
+//! (RFC 7306 immediate data and atomics). Both peers must set it to use them.
+#define MPA_RR_FLAG_SUIW_EXT	__cpu_to_be16(0x0100)
+
+//! Revision negotiated by the last blocking mpa_client_connect/mpa_server_accept;
+//! handshakes driven with mpa_handshake_progress keep theirs in mpa_handshake
 extern int mpa_protocol_version;
 
 /**
@@ -63,16 +68,91 @@ int mpa_send_rr(int sockfd, const void* pdata, __u8 pd_len, int req);
 int mpa_recv_rr(int sockfd, struct siw_mpa_info* info);
 
 /**
- * @brief 
+ * Resumable MPA request/reply exchange for non-blocking sockets
+ *
+ * The client sends its request and then reads the reply. The server reads
+ * the request, stops in MPA_HS_REQ_RCVD until the consumer decides with
+ * mpa_handshake_reply, then sends the reply. Many handshakes can be
+ * driven from one thread by calling mpa_handshake_progress whenever
+ * their socket becomes readable or writable.
+ */
+enum mpa_hs_state {
+    MPA_HS_SEND_RR,
+    MPA_HS_RECV_HDR,
+    MPA_HS_RECV_PDATA,
+    //! Server only: request received, waiting for mpa_handshake_reply
+    MPA_HS_REQ_RCVD,
+    MPA_HS_DONE,
+    //! Peer sent a reply with MPA_RR_FLAG_REJECT set
+    MPA_HS_REJECTED,
+};
+
+struct mpa_handshake {
+    int sockfd;
+    int is_client;
+    enum mpa_hs_state state;
+
+    //! Outgoing req/rep: header followed by private data
+    char out[sizeof(struct mpa_rr) + MPA_MAX_PRIVDATA];
+    int out_len;
+    int out_off;
+
+    //! Peer req/rep, header then private data
+    struct mpa_rr peer;
+    char pdata[MPA_MAX_PRIVDATA];
+    int in_off;
+
+    //! Revision the peer's req/rep carried, 0 until it is received
+    int revision;
+};
+
+/**
+ * @brief starts a handshake on a connected socket
+ * 
+ * @param pdata private data of the request (client), ignored by the server
+ * @param pd_len length of the private data
+ */
+void mpa_handshake_init(struct mpa_handshake* hs, int sockfd, int is_client,
+                        const void* pdata, __u8 pd_len);
+
+/**
+ * @brief advances the handshake as far as the socket allows without blocking
+ * 
+ * @return int the new state, or < 0 if the connection or the peer failed
+ */
+int mpa_handshake_progress(struct mpa_handshake* hs);
+
+/**
+ * @brief server side: answers a request received in MPA_HS_REQ_RCVD
+ * 
+ * @param reject non-zero to send the reply with MPA_RR_FLAG_REJECT
+ * @return int 0, or < 0 if the handshake is not waiting for a reply
+ */
+int mpa_handshake_reply(struct mpa_handshake* hs, const void* pdata, __u8 pd_len, int reject);
+
+//! Private data length received from the peer
+static inline __u16 mpa_handshake_pd_len(const struct mpa_handshake* hs)
+{
+    return __be16_to_cpu(hs->peer.params.pd_len);
+}
+
+//! Once MPA_HS_DONE: 1 if both peers support the SoftUiWarp extensions
+int mpa_handshake_suiw_ext(const struct mpa_handshake* hs);
+
+/**
+ * @brief runs the client side of the handshake, blocking until it is done
  * 
  * @param sockfd TCP connection socket
  * @param pdata_send private data to be sent
  * @param pd_len length of private data to be sent
- * @param pdata_recv private data to be received. Must be large enough to hold
- * @return int number of bytes received, < 0 if error
+ * @param pdata_recv private data to be received, may be NULL. Must be able
+ *        to hold MPA_MAX_PRIVDATA bytes
+ * @return int 1 if the peer also supports the SoftUiWarp extensions
+ *         (MPA_RR_FLAG_SUIW_EXT), 0 if not, < 0 if error
  */
 int mpa_client_connect(int sockfd, void* pdata_send, __u8 pd_len, void* pdata_recv);
 
+//! Server side of mpa_client_connect, always accepts. Same return value
 int mpa_server_accept(int sockfd, void *pdata_send, __u8 pd_len, void* pdata_recv);
 
 int mpa_send(int sockfd, sge* sg_list, int num_sge, int flags);
@@ -30,6 +30,118 @@
 #include "lwlog.h"
 #include "pthread.h"
 #include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+
+//! Forward iterator over a `next`-linked WR chain, so a chain can be
+//! handed to `enqueue_bulk` without copying it into an array first
+template <typename WR>
+struct wr_chain_iter {
+    WR* wr;
+
+    WR& operator*() const { return *wr; }
+    wr_chain_iter& operator++() { wr = wr->next; return *this; }
+    wr_chain_iter operator++(int) { wr_chain_iter it = *this; wr = wr->next; return it; }
+};
+
+//! Forward iterator yielding the untagged buffer of each receive WR in a
+//! chain, for the same single `enqueue_bulk`
+struct recv_buf_iter {
+    struct recv_wr* wr;
+
+    struct untagged_buffer operator*() const {
+        struct untagged_buffer buf;
+        buf.data = wr->num_sge ? (char*)wr->sg_list[0].addr : NULL;
+        buf.len = wr->num_sge ? wr->sg_list[0].length : 0;
+        buf.next = NULL;
+        return buf;
+    }
+    recv_buf_iter& operator++() { wr = wr->next; return *this; }
+    recv_buf_iter operator++(int) { recv_buf_iter it = *this; wr = wr->next; return it; }
+};
+
+//! sg_list is cleared to mark the WR as self-contained; rnic_send points
+//! it back at `sge` once the WR has settled in its final slot.
+void rdmap_prep_send_wr(struct send_wr* wr)
+{
+    if (wr->send_flags & SEND_INLINE)
+    {
+        char* data = (char*)&wr->sge[1];
+        uint32_t len = 0;
+        for (int i = 0; i < wr->num_sge; i++)
+        {
+            memcpy(data + len, (void*)wr->sg_list[i].addr, wr->sg_list[i].length);
+            len += wr->sg_list[i].length;
+        }
+        wr->sge[0].length = len;
+        wr->sge[0].lkey = 0;
+        wr->num_sge = 1;
+    }
+    else if (wr->num_sge <= SIW_MAX_SGE)
+    {
+        memcpy(wr->sge, wr->sg_list, wr->num_sge * sizeof(struct sge));
+    }
+    else
+    {
+        //! Too many to copy, caller keeps sg_list alive until completion
+        return;
+    }
+    wr->sg_list = NULL;
+}
+
+//! Like wr_chain_iter, but yields a prepared copy of each WR, which
+//! `enqueue_bulk` constructs directly in the SQ slot
+struct send_wr_prep_iter {
+    struct send_wr* wr;
+
+    struct send_wr operator*() const { struct send_wr slot = *wr; rdmap_prep_send_wr(&slot); return slot; }
+    send_wr_prep_iter& operator++() { wr = wr->next; return *this; }
+    send_wr_prep_iter operator++(int) { send_wr_prep_iter it = *this; wr = wr->next; return it; }
+};
+
+//! Fetch-Add with an RFC 7306 Add Mask: a set mask bit is the top of a
+//! field, and the carry out of it is dropped
+static inline uint64_t rdmap_masked_add(uint64_t orig, uint64_t add, uint64_t mask)
+{
+    uint64_t sum = 0, carry = 0;
+    for (int i = 0; i < 64; i++)
+    {
+        uint64_t a = (orig >> i) & 1, b = (add >> i) & 1;
+        sum |= (a ^ b ^ carry) << i;
+        carry = ((a & b) | (carry & (a ^ b))) & ~((mask >> i) & 1);
+    }
+    return sum;
+}
+
+//! Executes an Atomic Request (fields in host order) against `target`
+//! and returns the original value
+static inline uint64_t rdmap_do_atomic(struct rdmap_atomic_req_fields* req, uint64_t* target)
+{
+    uint64_t orig, val;
+    if (req->op == RDMAP_ATOMIC_OP_FETCH_ADD)
+    {
+        if (!req->add_swap_mask)
+            return __atomic_fetch_add(target, req->add_swap, __ATOMIC_SEQ_CST);
+
+        orig = __atomic_load_n(target, __ATOMIC_RELAXED);
+        do {
+            val = rdmap_masked_add(orig, req->add_swap, req->add_swap_mask);
+        } while (!__atomic_compare_exchange_n(target, &orig, val, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+        return orig;
+    }
+
+    //! Compare and Swap, only the masked bits take part
+    orig = __atomic_load_n(target, __ATOMIC_RELAXED);
+    do {
+        if ((orig ^ req->compare) & req->compare_mask) break;
+        val = (orig & ~req->add_swap_mask) | (req->add_swap & req->add_swap_mask);
+    } while (!__atomic_compare_exchange_n(target, &orig, val, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    return orig;
+}
 
 //! Main receive loop run in a separate thread
 //! TODO:
@@ -40,23 +152,39 @@ void* rnic_recv(void* ctx_ptr)
     struct rdmap_message message;
 
     moodycamel::ConcurrentQueue<recv_wr>* rq = ctx->recv_q->recv_q;
-    moodycamel::ConcurrentQueue<work_completion>* recv_cq = ctx->recv_q->cq->q;
-    moodycamel::ConcurrentQueue<work_completion>* cq = ctx->send_q->cq->q;
+    struct cq* recv_cq = ctx->recv_q->cq;
+    struct cq* cq = ctx->send_q->cq;
     moodycamel::ConcurrentQueue<work_completion>* pending_cq = ctx->send_q->cq->pending_q;
 
     struct recv_wr wr;
     struct work_completion wce;
+    //! Length of the last RDMA Write, reported by the Immediate Data
+    //! message that follows a Write with Immediate
+    uint32_t write_len = 0;
     
     //! Only for read responses
-    moodycamel::ConcurrentQueue<send_wr>* sq = ctx->send_q->send_q;
     struct send_wr read_resp;
-    struct sge sg;
     struct rdmap_read_req_fields* read_req;
 
+    //! Descriptor travels inside the WR, so the next request cannot
+    //! overwrite it before rnic_send has sent this response
     read_resp.opcode = rdma_opcode::RDMAP_RDMA_READ_RESP;
     read_resp.wr_id = 1001;
-    read_resp.sg_list = &sg;
+    read_resp.sg_list = NULL;
     read_resp.num_sge = 1;
+
+    //! Only for atomic responses, sent inline
+    struct send_wr atomic_resp;
+    struct rdmap_atomic_req_fields* atomic_req;
+    struct rdmap_atomic_resp_fields atomic_fields;
+    struct rdmap_atomic_pending atomic_pending;
+
+    atomic_resp.opcode = rdma_opcode::RDMAP_ATOMIC_RESP;
+    atomic_resp.wr_id = 0;
+    atomic_resp.send_flags = SEND_INLINE;
+    atomic_resp.sg_list = NULL;
+    atomic_resp.num_sge = 1;
+    atomic_resp.sge[0].length = sizeof(struct rdmap_atomic_resp_fields);
     while(ctx->connected)
     {
         lwlog_debug("rnic_recv");
@@ -73,7 +201,7 @@ void* rnic_recv(void* ctx_ptr)
             case rdma_opcode::RDMAP_RDMA_WRITE: {
                 assert(ddp_is_tagged(ddp_message.hdr.bits));
                 lwlog_info("Someone wrote %u bytes at %p", ddp_message.len, ddp_message.tag_buf.data);
-                //! do nothing :)
+                write_len = ddp_message.len;
                 break;
             }
             case rdma_opcode::RDMAP_RDMA_READ_REQ: {
@@ -101,18 +229,19 @@ void* rnic_recv(void* ctx_ptr)
                     lwlog_err("Read request for stag %u not found", read_req->src_tag);
                 }
 
-                sg.addr = read_req->src_TO;
-                sg.lkey = read_req->src_tag;
-                sg.length = read_req->rdma_rd_sz;
+                read_resp.sge[0].addr = read_req->src_TO;
+                read_resp.sge[0].lkey = read_req->src_tag;
+                read_resp.sge[0].length = read_req->rdma_rd_sz;
 
                 read_resp.wr.rdma.rkey = read_req->sink_tag;
                 read_resp.wr.rdma.remote_addr = read_req->sink_TO;
                 
-                lwlog_debug("Posting Read response to SQ");
-                int pushed = sq->enqueue(read_resp);
+                //! Not through the SQ, so a fenced WR there cannot hold it up
+                lwlog_debug("Posting Read response");
+                int pushed = ctx->resp_q->enqueue(read_resp);
                 while(unlikely(!pushed)) {
                     lwlog_debug("Posting failed???");
-                    pushed = sq->enqueue(read_resp);
+                    pushed = ctx->resp_q->enqueue(read_resp);
                 };
                 read_resp.wr_id++;
                 
@@ -132,14 +261,125 @@ void* rnic_recv(void* ctx_ptr)
 
                 //! Check if wce matches with work that was done
                 wce.byte_len = ret;
-                cq->enqueue(wce);
+                cq_push(cq, wce);
+                __atomic_fetch_add(&ctx->reads_completed, 1, __ATOMIC_RELEASE);
+                break;
+            }
+            case rdma_opcode::RDMAP_ATOMIC_REQ: {
+                assert(!ddp_is_tagged(ddp_message.hdr.bits));
+                atomic_req = (struct rdmap_atomic_req_fields*) ddp_message.untag_buf.data;
+                atomic_req->op = ntohl(atomic_req->op);
+                atomic_req->req_id = ntohl(atomic_req->req_id);
+                atomic_req->remote_tag = ntohl(atomic_req->remote_tag);
+                atomic_req->remote_TO = ntohll(atomic_req->remote_TO);
+                atomic_req->add_swap = ntohll(atomic_req->add_swap);
+                atomic_req->add_swap_mask = ntohll(atomic_req->add_swap_mask);
+                atomic_req->compare = ntohll(atomic_req->compare);
+                atomic_req->compare_mask = ntohll(atomic_req->compare_mask);
+
+                //! Target must be an aligned 64-bit word inside the region.
+                //! A bad one still gets a response, so the requester's WR
+                //! completes in order with an error
+                auto it = ctx->ddp_ctx->tagged_buffers.find(atomic_req->remote_tag);
+                uint64_t orig = 0;
+                if (unlikely(!ctx->suiw_ext || it == ctx->ddp_ctx->tagged_buffers.end()
+                        || atomic_req->remote_TO % sizeof(uint64_t)
+                        || atomic_req->remote_TO < (uint64_t)it->second.data
+                        || atomic_req->remote_TO + sizeof(uint64_t) > (uint64_t)it->second.data + it->second.len))
+                {
+                    lwlog_err("Invalid atomic request for stag %u TO 0x%llx", atomic_req->remote_tag, atomic_req->remote_TO);
+                    atomic_fields.status = htonl(RDMAP_ATOMIC_STATUS_REM_ACCESS);
+                }
+                else
+                {
+                    orig = rdmap_do_atomic(atomic_req, (uint64_t*)atomic_req->remote_TO);
+                    atomic_fields.status = htonl(RDMAP_ATOMIC_STATUS_OK);
+                }
+                atomic_fields.req_id = htonl(atomic_req->req_id);
+                //! htonll evaluates its argument twice, hence the local
+                atomic_fields.orig_value = htonll(orig);
+                memcpy(&atomic_resp.sge[1], &atomic_fields, sizeof(atomic_fields));
+
+                lwlog_debug("Posting Atomic response");
+                int pushed = ctx->resp_q->enqueue(atomic_resp);
+                while(unlikely(!pushed)) {
+                    pushed = ctx->resp_q->enqueue(atomic_resp);
+                };
+                atomic_resp.wr_id++;
+
+                //! Replenish untagged buffer in queue 3
+                ddp_post_recv(ctx->ddp_ctx, ATOMIC_REQ_QN, &ddp_message.untag_buf, 1);
+                break;
+            }
+            case rdma_opcode::RDMAP_ATOMIC_RESP: {
+                assert(!ddp_is_tagged(ddp_message.hdr.bits));
+                struct rdmap_atomic_resp_fields* fields = (struct rdmap_atomic_resp_fields*) ddp_message.untag_buf.data;
+                int found = ctx->atomic_pending_q->try_dequeue(atomic_pending);
+                if (unlikely(!found))
+                {
+                    lwlog_err("atomic response received but nothing is pending");
+                    ddp_post_recv(ctx->ddp_ctx, ATOMIC_RESP_QN, &ddp_message.untag_buf, 1);
+                    break;
+                }
+
+                //! Responses come back in request order
+                if (unlikely(ntohl(fields->req_id) != atomic_pending.req_id))
+                {
+                    lwlog_err("atomic response %u does not match request %u", ntohl(fields->req_id), atomic_pending.req_id);
+                    atomic_pending.wce.status = WC_BAD_RESP_ERR;
+                }
+                else if (unlikely(ntohl(fields->status) != RDMAP_ATOMIC_STATUS_OK))
+                {
+                    lwlog_err("atomic request %u failed at the responder (status %u)", atomic_pending.req_id, ntohl(fields->status));
+                    atomic_pending.wce.status = WC_REM_ACCESS_ERR;
+                }
+                else
+                {
+                    uint64_t orig = ntohll(fields->orig_value);
+                    memcpy((void*)atomic_pending.result_addr, &orig, sizeof(orig));
+                }
+                cq_push(cq, atomic_pending.wce);
+                __atomic_fetch_add(&ctx->reads_completed, 1, __ATOMIC_RELEASE);
+
+                //! Replenish untagged buffer in queue 4
+                ddp_post_recv(ctx->ddp_ctx, ATOMIC_RESP_QN, &ddp_message.untag_buf, 1);
+                break;
+            }
+            case rdma_opcode::RDMAP_IMMEDIATE_SE:
+            case rdma_opcode::RDMAP_IMMEDIATE: {
+                assert(!ddp_is_tagged(ddp_message.hdr.bits));
+                if (unlikely(!ctx->suiw_ext))
+                {
+                    lwlog_err("Immediate Data received but not negotiated");
+                    break;
+                }
+                //! Completes the preceding RDMA Write, consumes one RQ entry
+                uint32_t byte_len = write_len;
+                write_len = 0;
+                int found = rq->try_dequeue(wr);
+                if (unlikely(!found))
+                {
+                    //! Dropped like an untagged message with no buffer;
+                    //! ddp_recv already counted it if it found none either
+                    lwlog_err("no entry in receive request queue, immediate dropped");
+                    if (ddp_message.untag_buf.data)
+                        __atomic_fetch_add(&ctx->ddp_ctx->rnr_drops, 1, __ATOMIC_RELAXED);
+                    break;
+                }
+                wce.opcode = WC_RECV_RDMA_WITH_IMM;
+                wce.wc_flags = WC_WITH_IMM;
+                wce.imm_data = ddp_message.untagged_metadata.rsvdULP2;
+                wce.byte_len = byte_len;
+                wce.status = WC_SUCCESS;
+                wce.wr_id = wr.wr_id;
+                cq_push(recv_cq, wce);
                 break;
             }
             case rdma_opcode::RDMAP_SEND_SE_INVAL:
             case rdma_opcode::RDMAP_SEND_INVAL: {
                 //! TODO: Handle Invalidation
                 struct stag_t stag;
-                stag.tag = ddp_message.tagged_metadata.rsvdULP1;
+                stag.tag = ntohl(ddp_message.untagged_metadata.rsvdULP2);
                 int erased = rdma_invalidate(ctx, &stag);
                 if (erased <= 0)
                 {
@@ -148,20 +388,41 @@ void* rnic_recv(void* ctx_ptr)
                 }
                 //! fallover to SEND
             }
+            case rdma_opcode::RDMAP_SEND_SE_IMM:
+            case rdma_opcode::RDMAP_SEND_IMM:
             case rdma_opcode::RDMAP_SEND_SE: //! fallover to SEND
             case rdma_opcode::RDMAP_SEND: {
                 assert(!ddp_is_tagged(ddp_message.hdr.bits));
+                bool imm = opcode == RDMAP_SEND_IMM || opcode == RDMAP_SEND_SE_IMM;
+                //! Rejected before it can take a posted receive
+                if (unlikely(imm && !ctx->suiw_ext))
+                {
+                    lwlog_err("Send with Immediate received but not negotiated");
+                    break;
+                }
                 int found = rq->try_dequeue(wr);
                 if (unlikely(!found))
                 {
                     lwlog_err("no entry in receive request queue");
                     break;
                 }
-                wce.opcode = (enum wc_opcode) opcode;
-                wce.byte_len = ret;
+                wce.wc_flags = 0;
+                if (imm)
+                {
+                    wce.wc_flags = WC_WITH_IMM;
+                    wce.imm_data = ddp_message.untagged_metadata.rsvdULP2;
+                }
+                else if (opcode == RDMAP_SEND_INVAL || opcode == RDMAP_SEND_SE_INVAL)
+                {
+                    wce.wc_flags = WC_WITH_INV;
+                    wce.invalidated_rkey = ntohl(ddp_message.untagged_metadata.rsvdULP2);
+                }
+                //! Like ibv_wc, the flavour of Send shows in wc_flags only
+                wce.opcode = WC_RECV;
+                wce.byte_len = ddp_message.len;
                 wce.status = WC_SUCCESS;
                 wce.wr_id = wr.wr_id;
-                cq->enqueue(wce);
+                cq_push(recv_cq, wce);
                 break;
             }
             case rdma_opcode::RDMAP_TERMINATE: {
@@ -185,29 +446,69 @@ void* rnic_send(void* ctx_ptr)
     struct rdmap_stream_context* ctx = (struct rdmap_stream_context*)ctx_ptr;
     assert(ctx->send_q->wq_type == WQT_SQ);
     moodycamel::ConcurrentQueue<send_wr>* q = ctx->send_q->send_q;
-    moodycamel::ConcurrentQueue<work_completion>* cq = ctx->send_q->cq->q;
+    struct cq* cq = ctx->send_q->cq;
     moodycamel::ConcurrentQueue<work_completion>* pending_cq = ctx->send_q->cq->pending_q;
 
-    struct send_wr req;
+    struct send_wr reqs[RNIC_SEND_BATCH];
+    size_t num_reqs = 0, next_req = 0;
+    struct send_wr resp;
+    struct rdmap_atomic_pending atomic_pending;
+    __u32 atomic_req_id = 0;
+    //! Reads and atomics sent, compared against ctx->reads_completed
+    uint64_t reads_issued = 0;
     __u8 rdma_hdr = 1 << 6;
+    //! Each untagged queue has its own MSN sequence
+    __u32 send_msn = 1, read_msn = 1, atomic_req_msn = 1, atomic_resp_msn = 1;
     struct work_completion wce;
     wce.src_qp = ctx->send_q->wq_num;
     while (ctx->connected)
     {
-        int found = q->try_dequeue(req);
-        if (!found) continue;
+        //! Responses go first, the requester is waiting on them
+        struct send_wr* next;
+        if (ctx->resp_q->try_dequeue(resp))
+        {
+            next = &resp;
+        }
+        else
+        {
+            //! Drain the SQ in bursts, so a posted chain costs one dequeue
+            if (next_req == num_reqs)
+            {
+                num_reqs = q->try_dequeue_bulk(reqs, RNIC_SEND_BATCH);
+                next_req = 0;
+                if (!num_reqs) continue;
+            }
+            //! A fenced WR, and so everything behind it, waits at the head
+            //! of the SQ until all earlier reads and atomics have completed.
+            //! Responses keep flowing meanwhile.
+            if (unlikely((reqs[next_req].send_flags & SEND_FENCE)
+                    && __atomic_load_n(&ctx->reads_completed, __ATOMIC_ACQUIRE) != reads_issued))
+            {
+                continue;
+            }
+            next = &reqs[next_req++];
+        }
+        struct send_wr& req = *next;
+        if (req.sg_list == NULL)
+        {
+            req.sg_list = req.sge;
+            if (req.send_flags & SEND_INLINE)
+                req.sge[0].addr = (uint64_t)&req.sge[1];
+        }
         rdma_hdr = (1 << 6) | req.opcode;
         switch(req.opcode)
         {
+            case rdma_opcode::RDMAP_SEND_SE_IMM:
+            case rdma_opcode::RDMAP_SEND_IMM:
             case rdma_opcode::RDMAP_SEND_SE:
         	case rdma_opcode::RDMAP_SEND: {
                 lwlog_info("Sending RDMAP Send Message");
                 struct ddp_untagged_meta ddp_hdr;
-                static __u32 msn = 1;
 
                 ddp_hdr.rsvdULP1 = rdma_hdr;
+                ddp_hdr.rsvdULP2 = (req.opcode == RDMAP_SEND_IMM || req.opcode == RDMAP_SEND_SE_IMM) ? req.imm_data : 0;
                 ddp_hdr.qn = htonl(SEND_QN);
-                ddp_hdr.msn = htonl(msn++);
+                ddp_hdr.msn = htonl(send_msn++);
 
                 int ret = ddp_send_untagged(ctx->ddp_ctx, &ddp_hdr, req.sg_list, req.num_sge);
                 
@@ -223,18 +524,17 @@ void* rnic_send(void* ctx_ptr)
                 {
                     wce.status = WC_SUCCESS;
                 }
-                cq->enqueue(wce);
+                cq_push(cq, wce);
                 break;
             }
             case rdma_opcode::RDMAP_SEND_SE_INVAL: 
             case rdma_opcode::RDMAP_SEND_INVAL: {
                 struct ddp_untagged_meta ddp_hdr;
-                static __u32 msn = 1;
                 
                 ddp_hdr.rsvdULP1 = rdma_hdr;
                 ddp_hdr.rsvdULP2 = htonl(req.invalidate_rkey);
                 ddp_hdr.qn = htonl(SEND_QN);
-                ddp_hdr.msn = htonl(msn++);
+                ddp_hdr.msn = htonl(send_msn++);
                 int ret = ddp_send_untagged(ctx->ddp_ctx, &ddp_hdr, req.sg_list, req.num_sge);
                 
                 send_wr_to_wce(&req, &wce);
@@ -248,15 +548,14 @@ void* rnic_send(void* ctx_ptr)
                 {
                     wce.status = WC_SUCCESS;
                 }
-                cq->enqueue(wce);
+                cq_push(cq, wce);
                 break;
             }
         	case rdma_opcode::RDMAP_RDMA_READ_REQ: {
                 struct ddp_untagged_meta ddp_hdr;
-                static __u32 msn = 1;
                 ddp_hdr.rsvdULP1 = rdma_hdr;
                 ddp_hdr.qn = htonl(READ_QN);
-                ddp_hdr.msn = htonl(msn++);
+                ddp_hdr.msn = htonl(read_msn++);
                 if (req.num_sge != 1)
                 {
                     lwlog_err("Number of sge not 1 in read req (%d)", req.num_sge);
@@ -273,22 +572,22 @@ void* rnic_send(void* ctx_ptr)
                 struct sge message;
                 message.addr = (uint64_t)&fields;
                 message.length = sizeof(struct rdmap_read_req_fields);
-                int ret = ddp_send_untagged(ctx->ddp_ctx, &ddp_hdr, &message, 1);
-                
+
+                //! Must be enqueued in `pending` before the response can
+                //! possibly arrive. Shifted from `pending` to `cq` when
+                //! the read response is received
                 send_wr_to_wce(&req, &wce);
-                wce.byte_len = ret;
-                //! Notify completion queue
+                wce.byte_len = 0;
+                wce.status = WC_SUCCESS;
+                pending_cq->enqueue(wce);
+                reads_issued++;
+
+                int ret = ddp_send_untagged(ctx->ddp_ctx, &ddp_hdr, &message, 1);
                 if (unlikely(ret < 0))
                 {
+                    //! Stream is broken, the pending entry is never matched
                     wce.status = WC_FATAL_ERR;
-                    cq->enqueue(wce);
-                }
-                else 
-                {
-                    wce.status = WC_SUCCESS;
-                    //! Must be enqueued in `pending`
-                    //! Shifted from `pending` to `cq` when read response is received
-                    pending_cq->enqueue(wce);
+                    cq_push(cq, wce);
                 }
                 break;
             }
@@ -311,7 +610,110 @@ void* rnic_send(void* ctx_ptr)
                 {
                     wce.status = WC_SUCCESS;
                 }
-                cq->enqueue(wce);
+                cq_push(cq, wce);
+                break;
+            }
+            case rdma_opcode::RDMAP_RDMA_WRITE_IMM: {
+                //! The Write places the data, the Immediate Data message
+                //! behind it completes the Write at the peer
+                int ret = 0;
+                if (req.num_sge > 0)
+                {
+                    struct ddp_tagged_meta write_hdr;
+                    write_hdr.rsvdULP1 = (1 << 6) | rdma_opcode::RDMAP_RDMA_WRITE;
+                    write_hdr.tag = htonl(req.wr.rdma.rkey);
+                    write_hdr.TO = htonll(req.wr.rdma.remote_addr);
+                    ret = ddp_send_tagged(ctx->ddp_ctx, &write_hdr, req.sg_list, req.num_sge);
+                }
+                if (likely(ret >= 0))
+                {
+                    struct ddp_untagged_meta ddp_hdr;
+                    ddp_hdr.rsvdULP1 = (1 << 6) | ((req.send_flags & SEND_SOLICITED) ?
+                            rdma_opcode::RDMAP_IMMEDIATE_SE : rdma_opcode::RDMAP_IMMEDIATE);
+                    ddp_hdr.rsvdULP2 = req.imm_data;
+                    ddp_hdr.qn = htonl(SEND_QN);
+                    ddp_hdr.msn = htonl(send_msn++);
+                    ret = ddp_send_untagged(ctx->ddp_ctx, &ddp_hdr, NULL, 0);
+                }
+
+                send_wr_to_wce(&req, &wce);
+                wce.byte_len = ret;
+                //! Notify completion queue
+                if (unlikely(ret < 0))
+                {
+                    lwlog_err("Write with Immediate %lu failed", req.wr_id);
+                    wce.status = WC_FATAL_ERR;
+                }
+                else 
+                {
+                    wce.status = WC_SUCCESS;
+                }
+                cq_push(cq, wce);
+                break;
+            }
+            case rdma_opcode::RDMAP_ATOMIC_CMP_SWP:
+            case rdma_opcode::RDMAP_ATOMIC_FETCH_ADD: {
+                struct ddp_untagged_meta ddp_hdr;
+                ddp_hdr.rsvdULP1 = (1 << 6) | rdma_opcode::RDMAP_ATOMIC_REQ;
+                ddp_hdr.qn = htonl(ATOMIC_REQ_QN);
+                ddp_hdr.msn = htonl(atomic_req_msn++);
+
+                //! Plain 64-bit operations, all bits take part
+                struct rdmap_atomic_req_fields fields;
+                fields.req_id = htonl(atomic_req_id);
+                fields.remote_tag = htonl(req.wr.atomic.rkey);
+                fields.remote_TO = htonll(req.wr.atomic.remote_addr);
+                if (req.opcode == rdma_opcode::RDMAP_ATOMIC_FETCH_ADD)
+                {
+                    fields.op = htonl(RDMAP_ATOMIC_OP_FETCH_ADD);
+                    fields.add_swap = htonll(req.wr.atomic.compare_add);
+                    fields.add_swap_mask = 0;
+                    fields.compare = 0;
+                    fields.compare_mask = 0;
+                }
+                else
+                {
+                    fields.op = htonl(RDMAP_ATOMIC_OP_CMP_SWP);
+                    fields.add_swap = htonll(req.wr.atomic.swap);
+                    fields.add_swap_mask = ~0ULL;
+                    fields.compare = htonll(req.wr.atomic.compare_add);
+                    fields.compare_mask = ~0ULL;
+                }
+
+                //! Must be pending before the response can possibly arrive
+                send_wr_to_wce(&req, &wce);
+                wce.byte_len = sizeof(uint64_t);
+                wce.status = WC_SUCCESS;
+                atomic_pending.req_id = atomic_req_id++;
+                atomic_pending.result_addr = req.sg_list[0].addr;
+                atomic_pending.wce = wce;
+                ctx->atomic_pending_q->enqueue(atomic_pending);
+                reads_issued++;
+
+                struct sge message;
+                message.addr = (uint64_t)&fields;
+                message.length = sizeof(struct rdmap_atomic_req_fields);
+                int ret = ddp_send_untagged(ctx->ddp_ctx, &ddp_hdr, &message, 1);
+                if (unlikely(ret < 0))
+                {
+                    //! Stream is broken, the pending entry is never matched
+                    lwlog_err("Atomic Request %lu failed", req.wr_id);
+                    wce.status = WC_FATAL_ERR;
+                    cq_push(cq, wce);
+                }
+                break;
+            }
+            case rdma_opcode::RDMAP_ATOMIC_RESP: {
+                //! Generated by rnic_recv, no work completion
+                struct ddp_untagged_meta ddp_hdr;
+                ddp_hdr.rsvdULP1 = rdma_hdr;
+                ddp_hdr.qn = htonl(ATOMIC_RESP_QN);
+                ddp_hdr.msn = htonl(atomic_resp_msn++);
+                int ret = ddp_send_untagged(ctx->ddp_ctx, &ddp_hdr, req.sg_list, req.num_sge);
+                if (unlikely(ret < 0))
+                {
+                    lwlog_err("Atomic Response %lu failed", req.wr_id);
+                }
                 break;
             }
             case rdma_opcode::RDMAP_RDMA_READ_RESP: {
@@ -339,10 +741,56 @@ void* rnic_send(void* ctx_ptr)
     return NULL;
 }
 
+//! Raw syscalls, so the core does not need libnuma
+int rdmap_prefer_node(int node, struct rdmap_mempolicy* saved)
+{
+    if (node < 0 || node >= RDMAP_MAX_NUMA_NODES) return -EINVAL;
+    if (syscall(SYS_get_mempolicy, &saved->mode, saved->nodes, RDMAP_MAX_NUMA_NODES, NULL, 0))
+        return -errno;
+
+    unsigned long nodes[RDMAP_NODE_MASK_WORDS];
+    memset(nodes, 0, sizeof(nodes));
+    nodes[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    //! PREFERRED rather than BIND: a full node slows us down instead of failing
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes, RDMAP_MAX_NUMA_NODES + 1))
+        return -errno;
+    return 0;
+}
+
+void rdmap_restore_policy(const struct rdmap_mempolicy* saved)
+{
+    syscall(SYS_set_mempolicy, saved->mode, saved->nodes, RDMAP_MAX_NUMA_NODES + 1);
+}
 
 //! Init DDP Stream, DDP Queue setup, recv/send thread start
 struct rdmap_stream_context* rdmap_init_stream(struct rdmap_stream_init_attr* attr) {
 
+    //! A CPU set the threads cannot be given fails the stream up front
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    if (attr->cpus)
+    {
+        int err = pthread_attr_setaffinity_np(&thread_attr, sizeof(cpu_set_t), attr->cpus);
+        if (err != 0)
+        {
+            lwlog_err("Couldn't set progress thread affinity (%d)", err);
+            pthread_attr_destroy(&thread_attr);
+            return NULL;
+        }
+    }
+
+    //! Everything below, including the threads' stacks and whatever they
+    //! allocate later, comes from the requested node
+    struct rdmap_mempolicy saved_policy;
+    int placed = 0;
+    if (attr->numa_node >= 0)
+    {
+        int err = rdmap_prefer_node(attr->numa_node, &saved_policy);
+        if (err)
+            lwlog_warning("Couldn't place stream on NUMA node %d (%d)", attr->numa_node, err);
+        placed = err == 0;
+    }
+
     struct rdmap_stream_context* ctx = (struct rdmap_stream_context*) malloc(sizeof(struct rdmap_stream_context));
 
     //! Init DDP Stream
@@ -352,6 +800,7 @@ struct rdmap_stream_context* rdmap_init_stream(struct rdmap_stream_init_attr* at
     ctx->send_q = attr->send_q;
     ctx->recv_q = attr->recv_q;
     ctx->connected = 1;
+    ctx->suiw_ext = attr->suiw_ext;
 
     //! Init Read Untagged Buffers
     for (int i = 0; i < attr->max_pending_read_requests; i++)
@@ -362,35 +811,64 @@ struct rdmap_stream_context* rdmap_init_stream(struct rdmap_stream_init_attr* at
         ddp_post_recv(ctx->ddp_ctx, READ_QN, &buf, 1);
     }
 
+    //! Atomics share the limit on outstanding reads (IRD/ORD)
+    ctx->resp_q = new moodycamel::ConcurrentQueue<send_wr>(2 * attr->max_pending_read_requests);
+    ctx->reads_completed = 0;
+    ctx->atomic_pending_q = new moodycamel::ConcurrentQueue<rdmap_atomic_pending>(attr->max_pending_read_requests);
+    for (int i = 0; ctx->suiw_ext && i < attr->max_pending_read_requests; i++)
+    {
+        struct untagged_buffer buf;
+        buf.data = (char*) malloc(sizeof(struct rdmap_atomic_req_fields));
+        buf.len = sizeof(struct rdmap_atomic_req_fields);
+        ddp_post_recv(ctx->ddp_ctx, ATOMIC_REQ_QN, &buf, 1);
+
+        buf.data = (char*) malloc(sizeof(struct rdmap_atomic_resp_fields));
+        buf.len = sizeof(struct rdmap_atomic_resp_fields);
+        ddp_post_recv(ctx->ddp_ctx, ATOMIC_RESP_QN, &buf, 1);
+    }
+
     //! Receive Thread
-    int ret = pthread_create(&ctx->recv_thread, NULL, rnic_recv, ctx);
+    int ret = pthread_create(&ctx->recv_thread, &thread_attr, rnic_recv, ctx);
     if (ret != 0)
     {
         lwlog_err("Couldn't create receive thread (%d)", ret);
-        return NULL;
+        ctx = NULL;
+        goto out;
     }
+    pthread_setname_np(ctx->recv_thread, "rnic_recv");
 
     //! Send Thread
-    ret = pthread_create(&ctx->send_thread, NULL, rnic_send, ctx);
+    ret = pthread_create(&ctx->send_thread, &thread_attr, rnic_send, ctx);
     if (ret != 0)
     {
         lwlog_err("Couldn't create send thread (%d)", ret);
-        return NULL;
+        ctx = NULL;
+        goto out;
     }
+    pthread_setname_np(ctx->send_thread, "rnic_send");
 
+out:
+    pthread_attr_destroy(&thread_attr);
+    if (placed)
+        rdmap_restore_policy(&saved_policy);
     return ctx;
 }
 
 //! Free ddp stream structures, kill threads, 
 void rdmap_kill_stream(struct rdmap_stream_context* ctx) {
-    ddp_kill_stream(ctx->ddp_ctx);
-
-    //! Join with threads
+    //! Join with threads; rnic_recv may be blocked in recv, so wake it
+    //! by shutting the socket down before the DDP stream goes away
     ctx->connected = 0;
+    shutdown(ctx->ddp_ctx->sockfd, SHUT_RDWR);
 
     pthread_join(ctx->recv_thread, NULL);
     pthread_join(ctx->send_thread, NULL);
 
+    ddp_kill_stream(ctx->ddp_ctx);
+
+    delete ctx->resp_q;
+    delete ctx->atomic_pending_q;
+
     //! TODO: Free read request buffers
 }
 
@@ -398,21 +876,114 @@ void rdmap_kill_stream(struct rdmap_stream_context* ctx) {
 //! Use rdmap_stream_context->ddp_ctx for those
 
 
+//! Read responses and terminates are generated internally
+static inline int rdmap_user_opcode(struct rdmap_stream_context* ctx, enum rdma_opcode opcode)
+{
+    switch (opcode)
+    {
+        case rdma_opcode::RDMAP_SEND:
+        case rdma_opcode::RDMAP_SEND_SE:
+        case rdma_opcode::RDMAP_SEND_INVAL:
+        case rdma_opcode::RDMAP_SEND_SE_INVAL:
+        case rdma_opcode::RDMAP_RDMA_WRITE:
+        case rdma_opcode::RDMAP_RDMA_READ_REQ:
+            return 1;
+        case rdma_opcode::RDMAP_SEND_IMM:
+        case rdma_opcode::RDMAP_SEND_SE_IMM:
+        case rdma_opcode::RDMAP_RDMA_WRITE_IMM:
+        case rdma_opcode::RDMAP_ATOMIC_FETCH_ADD:
+        case rdma_opcode::RDMAP_ATOMIC_CMP_SWP:
+            return ctx->suiw_ext;
+        default:
+            return 0;
+    }
+}
+
+static inline int rdmap_is_atomic(enum rdma_opcode opcode)
+{
+    return opcode == rdma_opcode::RDMAP_ATOMIC_FETCH_ADD || opcode == rdma_opcode::RDMAP_ATOMIC_CMP_SWP;
+}
+
+//! Inline payloads must fit in sge[1..] and only make sense for
+//! operations that carry local data to the peer.
+//! Immediate data and atomics need the extensions negotiated at MPA time.
+int rdmap_check_send_wr(struct rdmap_stream_context* ctx, const struct send_wr* wr)
+{
+    if (unlikely(!rdmap_user_opcode(ctx, wr->opcode)))
+    {
+        lwlog_err("Invalid request opcode: %d", wr->opcode);
+        return -EINVAL;
+    }
+    if (rdmap_is_atomic(wr->opcode) && unlikely(wr->num_sge != 1
+            || wr->sg_list[0].length < sizeof(uint64_t)
+            || wr->wr.atomic.remote_addr % sizeof(uint64_t)))
+    {
+        lwlog_err("Atomic request needs one 8 byte sge and an aligned remote address");
+        return -EINVAL;
+    }
+    if (!(wr->send_flags & SEND_INLINE)) return 0;
+    if (unlikely(wr->opcode == rdma_opcode::RDMAP_RDMA_READ_REQ || rdmap_is_atomic(wr->opcode)))
+    {
+        lwlog_err("Inline not supported for read and atomic requests");
+        return -EINVAL;
+    }
+    uint64_t len = 0;
+    for (int i = 0; i < wr->num_sge; i++) len += wr->sg_list[i].length;
+    if (unlikely(len > SIW_MAX_INLINE))
+    {
+        lwlog_err("Inline data too long (%lu > %lu)", len, SIW_MAX_INLINE);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static inline int rdmap_enqueue_send_wr(struct rdmap_stream_context* ctx, struct send_wr& wr)
+{
+    int ret = rdmap_check_send_wr(ctx, &wr);
+    if (unlikely(ret < 0)) return ret;
+    struct send_wr slot = wr;
+    rdmap_prep_send_wr(&slot);
+    return ctx->send_q->send_q->enqueue(slot);
+}
+
 int rdmap_send(struct rdmap_stream_context* ctx, struct send_wr& wr)
 {
-    return ctx->send_q->send_q->enqueue(wr);
+    return rdmap_enqueue_send_wr(ctx, wr);
 }
 
 int rdmap_write(struct rdmap_stream_context* ctx, struct send_wr& wr)
 {
-    assert(wr.opcode == rdma_opcode::RDMAP_RDMA_WRITE);
-    return ctx->send_q->send_q->enqueue(wr);
+    assert(wr.opcode == rdma_opcode::RDMAP_RDMA_WRITE || wr.opcode == rdma_opcode::RDMAP_RDMA_WRITE_IMM);
+    return rdmap_enqueue_send_wr(ctx, wr);
 }
 
 int rdmap_read(struct rdmap_stream_context* ctx, struct send_wr& wr)
 {
     assert(wr.opcode == rdma_opcode::RDMAP_RDMA_READ_REQ);
-    return ctx->send_q->send_q->enqueue(wr);
+    return rdmap_enqueue_send_wr(ctx, wr);
+}
+
+int rdmap_post_send(struct rdmap_stream_context* ctx, struct send_wr* wr, struct send_wr** bad_wr)
+{
+    int ret = 0;
+    size_t num_wrs = 0;
+    struct send_wr* it = wr;
+    for (; it != NULL; it = it->next, num_wrs++)
+    {
+        ret = rdmap_check_send_wr(ctx, it);
+        if (unlikely(ret < 0)) break;
+    }
+    if (bad_wr) *bad_wr = it;
+    if (!num_wrs) return ret;
+
+    //! One enqueue for the whole chain
+    if (unlikely(!ctx->send_q->send_q->enqueue_bulk(send_wr_prep_iter{wr}, num_wrs)))
+    {
+        lwlog_err("Could not enqueue %lu send requests", num_wrs);
+        if (bad_wr) *bad_wr = wr;
+        return -ENOMEM;
+    }
+    return ret;
 }
 
 /**
@@ -424,19 +995,27 @@ int rdmap_read(struct rdmap_stream_context* ctx, struct send_wr& wr)
  */
 int rdma_post_recv(struct rdmap_stream_context* ctx, struct recv_wr& wr)
 {
-    //! Add to untagged buffer
-    struct untagged_buffer buf[wr.num_sge];
-    for (int i = 0; i < wr.num_sge; i++)
+    uint32_t num_wrs = 0;
+    for (struct recv_wr* it = &wr; it != NULL; it = it->next)
     {
-        buf[i].data = (char *)wr.sg_list[i].addr;
-        buf[i].len = wr.sg_list[i].length;
+        if (unlikely(it->num_sge < 0 || it->num_sge > RDMAP_MAX_RECV_SGE || ++num_wrs > ctx->recv_q->max_wr))
+        {
+            return -EINVAL;
+        }
     }
 
-    ddp_post_recv(ctx->ddp_ctx, SEND_QN, buf, wr.num_sge);
-
-    //! Add to queue
-    ctx->recv_q->recv_q->enqueue(wr);
-
+    //! Buffers first: if the RQ then fails to grow, a message finds a
+    //! buffer but no WR and is dropped, rather than completing a WR whose
+    //! data went nowhere. Each bulk enqueue is all or nothing.
+    if (unlikely(!ctx->ddp_ctx->queues[SEND_QN].q->enqueue_bulk(recv_buf_iter{&wr}, num_wrs)))
+    {
+        return -ENOMEM;
+    }
+    if (unlikely(!ctx->recv_q->recv_q->enqueue_bulk(wr_chain_iter<recv_wr>{&wr}, num_wrs)))
+    {
+        lwlog_err("receive queue is out of memory, %u buffers posted without a WR", num_wrs);
+        return -ENOMEM;
+    }
     return 0;
 }
 
@@ -56,6 +56,13 @@
  * 
  * 6. RDMA Read
  * 7. Terminate
+ * 8. RDMA Write / Send with Immediate Data (RFC 7306)
+ *    - only when both peers set MPA_RR_FLAG_SUIW_EXT, see
+ *      rdmap_stream_init_attr::suiw_ext
+ *    - the 32-bit immediate travels in the DDP rsvdULP2 field
+ * 9. Atomic Fetch-and-Add / Compare-and-Swap (RFC 7306)
+ *    - same negotiation as 8.
+ *    - executed by the responder's rnic_recv with CPU atomics
  * 
  * 
  * Memory Registration
@@ -80,6 +87,9 @@
       *  Queue Number 1 (used by RDMAP for RDMA Read operations).
 
       *  Queue Number 2 (used by RDMAP for Terminate operations).
+
+      *  Queue Number 3 (RFC 7306 Atomic Requests) and
+         Queue Number 4 (RFC 7306 Atomic Responses).
  * 
  * 
  * Read response handling?
@@ -90,6 +100,36 @@
 #define SEND_QN 0
 #define READ_QN 1
 #define TERMINATE_QN 2
+#define ATOMIC_REQ_QN 3
+#define ATOMIC_RESP_QN 4
+
+//! Max number of SQ entries the send thread dequeues at once
+#define RNIC_SEND_BATCH 16
+
+//! A receive is placed into a single untagged buffer, so it takes at
+//! most one SGE
+#define RDMAP_MAX_RECV_SGE 1
+
+//! Highest NUMA node id a stream can be placed on, plus one
+#define RDMAP_MAX_NUMA_NODES 1024
+#define RDMAP_NODE_MASK_WORDS (RDMAP_MAX_NUMA_NODES / (8 * sizeof(unsigned long)))
+
+struct rdmap_mempolicy {
+    int mode;
+    unsigned long nodes[RDMAP_NODE_MASK_WORDS];
+};
+
+/*
+ * Makes the calling thread prefer memory from `node` and saves its previous
+ * policy in `saved`. Threads created meanwhile inherit the preference.
+ * rdmap_init_stream uses it for rdmap_stream_init_attr::numa_node; callers
+ * wrap it around create_cq/create_wq to put the queues on the same node.
+ *  returns: 0 on success, < 0 if the policy could not be changed
+ */
+int rdmap_prefer_node(int node, struct rdmap_mempolicy* saved);
+
+//! Puts back the policy rdmap_prefer_node saved
+void rdmap_restore_policy(const struct rdmap_mempolicy* saved);
 
 //! Init DDP Stream, Queue setup, recv/send thread start
 struct rdmap_stream_context* rdmap_init_stream(struct rdmap_stream_init_attr* ctx);
@@ -114,11 +154,48 @@ int rdmap_send(struct rdmap_stream_context* ctx, struct send_wr& wr);
 int rdmap_write(struct rdmap_stream_context* ctx, struct send_wr& wr);
 int rdmap_read(struct rdmap_stream_context* ctx, struct send_wr& wr);
 
+/**
+ * @brief posts a chain of send WRs (linked through `next`) to the SQ
+ *        with a single bulk enqueue
+ * 
+ * WRs before `*bad_wr` are posted even if the call fails.
+ * 
+ * @param wr first WR of the chain
+ * @param bad_wr set to the first WR that was not posted, NULL if all were
+ * @return int 0 on success, < 0 on error
+ */
+int rdmap_post_send(struct rdmap_stream_context* ctx, struct send_wr* wr, struct send_wr** bad_wr);
+
+/**
+ * @brief checks that `wr` may be posted on `ctx`: opcode, atomic operands
+ *        and inline length
+ * 
+ * @return int 0 if it may, -EINVAL if not
+ */
+int rdmap_check_send_wr(struct rdmap_stream_context* ctx, const struct send_wr* wr);
+
+/**
+ * @brief turns a checked WR into its SQ slot form
+ * 
+ * Copies the descriptors (and with SEND_INLINE, the payload) into the
+ * WR itself, so nothing the caller owns is read after the post returns.
+ * For producers that build SQ slots themselves and hand them to
+ * `enqueue_bulk`, like the verbs shim.
+ */
+void rdmap_prep_send_wr(struct send_wr* wr);
+
 /**
  * @brief adds buffer to ddp queue `0` to receive sends from remote
  * 
+ * WRs chained through `wr.next` are posted together, with one bulk
+ * enqueue for the untagged buffers and one for the receive queue. Each
+ * WR takes exactly one untagged buffer (none for a zero-length receive),
+ * so the two queues stay in step.
+ * 
  * @param buf 
- * @return int 
+ * @return int 0 on success, -EINVAL if a WR has more than
+ *         RDMAP_MAX_RECV_SGE SGEs or the chain is longer than the RQ,
+ *         -ENOMEM if the queues could not grow
  */
 int rdma_post_recv(struct rdmap_stream_context*, struct recv_wr& wr);
 
@@ -31,6 +31,7 @@
 #include "common.h"
 #include "cq.h"
 #include <pthread.h>
+#include <sched.h>
 
 struct __attribute__((packed)) rdmap_ctrl {
     __u8 bits;
@@ -88,6 +89,52 @@ struct __attribute__((packed)) rdmap_terminate_hdr {
     __u32 ctrl_bits;
 };
 
+/**
+ * According to RFC 7306. All fields in network byte order.
+ * 
+ * Payload of an Atomic Request (untagged, queue 3)
+ * 
+ */
+enum rdmap_atomic_op {
+    RDMAP_ATOMIC_OP_FETCH_ADD = 0x0,
+    RDMAP_ATOMIC_OP_CMP_SWP = 0x1,
+};
+
+struct __attribute__((packed)) rdmap_atomic_req_fields {
+    __u32 op;
+    __u32 req_id;
+    __u32 remote_tag;
+    __u64 remote_TO;
+    __u64 add_swap;
+    //! Fetch-Add: a set bit ends a field, its carry is dropped
+    __u64 add_swap_mask;
+    __u64 compare;
+    __u64 compare_mask;
+};
+
+/**
+ * Payload of an Atomic Response (untagged, queue 4)
+ */
+struct __attribute__((packed)) rdmap_atomic_resp_fields {
+    __u32 req_id;
+    //! rdmap_atomic_status; orig_value is only valid on success
+    __u32 status;
+    __u64 orig_value;
+};
+
+enum rdmap_atomic_status {
+    RDMAP_ATOMIC_STATUS_OK = 0x0,
+    //! Unknown STag, or target not an aligned 64-bit word inside the region
+    RDMAP_ATOMIC_STATUS_REM_ACCESS = 0x1,
+};
+
+//! Requester side state of an Atomic Request waiting for its response
+struct rdmap_atomic_pending {
+    __u32 req_id;
+    uint64_t result_addr;
+    struct work_completion wce;
+};
+
 static inline __u8 get_rdmap_op(__u8 bits)
 {
     return bits & 0xF;
@@ -96,10 +143,20 @@ static inline __u8 get_rdmap_op(__u8 bits)
 struct rdmap_stream_context {
     struct ddp_stream_context* ddp_ctx;
     int connected = 0;
+    //! Peer negotiated the SoftUiWarp extensions (MPA_RR_FLAG_SUIW_EXT)
+    int suiw_ext = 0;
 
     struct wq* send_q;
     struct wq* recv_q;
 
+    //! Read and atomic responses built by rnic_recv, sent ahead of the
+    //! SQ by rnic_send
+    moodycamel::ConcurrentQueue<send_wr>* resp_q;
+    //! Issued by rnic_send, completed by rnic_recv in FIFO order
+    moodycamel::ConcurrentQueue<rdmap_atomic_pending>* atomic_pending_q;
+    //! Reads and atomics completed by rnic_recv, for SEND_FENCE
+    uint64_t reads_completed;
+
     pthread_t recv_thread;
     pthread_t send_thread;
 };
@@ -112,6 +169,15 @@ struct rdmap_stream_init_attr {
     struct wq* recv_q;
 
     int max_pending_read_requests;
+
+    //! Return value of mpa_client_connect/mpa_server_accept
+    int suiw_ext = 0;
+
+    //! CPUs the send/receive progress threads may run on, NULL for any
+    const cpu_set_t* cpus = NULL;
+    //! NUMA node the stream's queues, buffers and threads allocate from,
+    //! -1 to leave it to the default (first-touch) policy
+    int numa_node = -1;
 };
 
 #endif
\ No newline at end of file